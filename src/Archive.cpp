@@ -1,130 +1,423 @@
 #include <QImage>
 #include <QByteArray>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFile>
+#include <QHash>
 #include <QMap>
+#include <QMutexLocker>
+#include <QSaveFile>
 #include <QString>
+#include <QThreadPool>
+#include <QVector>
+
+#include <deque>
 #include <QIODevice>
 #include <QDebug>
 #include <archive.h>
 #include <archive_entry.h>
 
+#include "Archive.h"
+#include "Pool.h"
+#include "Tiles.h"
+
 extern int screenWidth;
 extern int screenHeight;
 
-class ArchiveStorage {
-public:
-    void add(const QString& path, const QImage& image) {
-        values[path] = image;
-    }
-
-    void create(const QString& archiveFileName) {
-        // Open the archive file
-        struct archive* ar = archive_write_new();
-        archive_write_add_filter_gzip(ar);
-        archive_write_set_format_pax_restricted(ar);
-        archive_write_open_filename(ar, archiveFileName.toStdString().c_str());
-        // write config
-        struct archive_entry* entry = archive_entry_new();
-        QString config = QString::number(screenWidth) + "x" + QString::number(screenHeight);
-        archive_entry_set_pathname(entry, "config");
-        archive_entry_set_filetype(entry, AE_IFREG);
-        archive_entry_set_perm(entry, 0644);
-        archive_entry_set_size(entry, config.size());
-        archive_write_header(ar, entry);
-        archive_write_data(ar, config.toStdString().c_str(), config.size());
-        archive_entry_free(entry);
-        
-        for (auto it = values.begin(); it != values.end(); ++it) {
-            QString path = it.key();
-            QImage image = it.value();
-            // Convert QImage to a QByteArray
-            QByteArray imageData(reinterpret_cast<const char*>(image.constBits()), image.sizeInBytes());
-            // Create an entry and write image data to the archive
-            struct archive_entry* entry = archive_entry_new();
-            printf("Compress:%s\n", path.toStdString().c_str());
-            archive_entry_set_pathname(entry, path.toStdString().c_str());
-            archive_entry_set_filetype(entry, AE_IFREG);
-            archive_entry_set_perm(entry, 0644);
-            archive_entry_set_size(entry, imageData.size());
-            archive_write_header(ar, entry);
-            archive_write_data(ar, imageData.data(), imageData.size());
-            archive_entry_free(entry);
-        }
-        // Clean up
-        archive_write_close(ar);
-        archive_write_free(ar);
-    }
-
-    QMap<QString, QImage> load(const QString& archiveFileName) {
-        QMap<QString, QImage> values;
-        // Open the archive file
-        struct archive *ar;
-        struct archive_entry *entry;
-        ar = archive_read_new();
-        archive_read_support_filter_all(ar);
-        archive_read_support_format_all(ar);
-        int r = archive_read_open_filename(ar, archiveFileName.toStdString().c_str(), 10240); // 10240 is the block size
-        if (r != ARCHIVE_OK) {
-            qDebug() << "Failed to open archive: " << archive_error_string(ar);
-            return values;
-        }
-        int width = screenWidth;
-        int height = screenHeight;
-        while (archive_read_next_header(ar, &entry) == ARCHIVE_OK) {
-            // Get entry name
-            const char* entryName = archive_entry_pathname(entry);
-            // Check if it's an image file (you may need to modify this condition)
-            if (entryName) {
-                // Extract the image data
-                QByteArray *imageData = new QByteArray();
-                char buff[10240];
-                size_t size;
-                size_t total_size = 0;
-                while ((size = archive_read_data(ar, buff, sizeof(buff))) > 0) {
-                    if(size > 10240){
-                        break;
-                    }
-                    // printf("Read: %ld bytes\n", size);
-                    imageData->append(buff, size);
-                    total_size+= size;
-                }
-                printf("Decompress:%s %ld\n", entryName, total_size);
-                if(strcmp(entryName, "config") == 0){
-                    QStringList res = QString::fromUtf8(*imageData).split("x");
-                    width = res[0].toInt();
-                    height = res[1].toInt();
-                    continue;
-                }
-                QImage image = QImage(reinterpret_cast<const uchar*>(imageData->data()), width, height, QImage::Format_ARGB32);
-                if (image.isNull()) {
-                    puts("Image load fail");
-                    continue;
-                }
-                image = image.scaled(screenWidth, screenHeight);
-                values.insert(QString(entryName), image);
-            } else {
-                break;
+/*
+.pen v2 layout, numbers are big endian:
+ - header: magic, version, offset of the index
+ - frame data: zlib compressed tile lists
+ - index: page count, then for each page
+   type, overlay, width, height and frame count,
+   then codec, offset and size of each frame
+A tile list has the tile count, then the position and the raw ARGB32 rows
+of every tile. CODEC_TILES frames have the tiles which are not fully
+transparent, CODEC_DELTA frames have the tiles which are different from
+the previous frame of the page. Frames with the same codec and data are
+stored once and share their offset.
+v1 files are gzip compressed tar files of raw frames.
+*/
+#define PEN_MAGIC 0x50454e32
+#define PEN_VERSION 2
+// fastest zlib level, most of the data is skipped tiles anyway
+#define PEN_LEVEL 1
+#define PEN_MAX_SIZE 16384
+
+static QByteArray encodeTiles(const QImage &image, const QList<QPoint> &tiles){
+    QByteArray raw;
+    QDataStream out(&raw, QIODevice::WriteOnly);
+    out << (quint32)tiles.size();
+    for(const QPoint &pos : tiles){
+        QRect rect = tileRect(image, pos);
+        out << (quint16)pos.x() << (quint16)pos.y();
+        for(int y = rect.top(); y <= rect.bottom(); y++){
+            out.writeRawData(reinterpret_cast<const char*>(image.constScanLine(y) + rect.x()*sizeof(QRgb)),
+                rect.width()*sizeof(QRgb));
+        }
+    }
+    return qCompress(raw, PEN_LEVEL);
+}
+
+// previous is null for CODEC_TILES frames
+QByteArray archive_encode(const QImage &frame, const QImage &previous){
+    QImage image = frame.convertToFormat(QImage::Format_ARGB32);
+    QImage last = previous.convertToFormat(QImage::Format_ARGB32);
+    QList<QPoint> used;
+    int cols = (image.width() + TILE_SIZE - 1) / TILE_SIZE;
+    int rows = (image.height() + TILE_SIZE - 1) / TILE_SIZE;
+    for(int ty = 0; ty < rows; ty++){
+        for(int tx = 0; tx < cols; tx++){
+            QRect rect = tileRect(image, QPoint(tx, ty));
+            if(last.isNull() ? !isTransparent(image, rect) : !sameRect(image, last, rect)){
+                used.append(QPoint(tx, ty));
             }
         }
-        // Close the archive
-        archive_read_close(ar);
+    }
+    return encodeTiles(image, used);
+}
+
+// draws the uncompressed tile list on the image
+static bool applyTiles(const QByteArray &raw, QImage &image){
+    QDataStream in(raw);
+    quint32 count;
+    in >> count;
+    for(quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++){
+        quint16 x, y;
+        in >> x >> y;
+        QRect rect = tileRect(image, QPoint(x, y));
+        if(rect.isEmpty()){
+            return false;
+        }
+        for(int line = rect.top(); line <= rect.bottom(); line++){
+            in.readRawData(reinterpret_cast<char*>(image.scanLine(line) + rect.x()*sizeof(QRgb)),
+                rect.width()*sizeof(QRgb));
+        }
+    }
+    return in.status() == QDataStream::Ok;
+}
+
+static QImage emptyFrame(const QSize &size){
+    QImage image(size, QImage::Format_ARGB32);
+    image.fill(Qt::transparent);
+    return image;
+}
+
+static QImage fitScreen(const QImage &image){
+    if(image.size() == QSize(screenWidth, screenHeight)){
+        return image;
+    }
+    return image.scaled(screenWidth, screenHeight);
+}
+
+bool archive_save(const QString& archiveFileName, const QList<ArchivePage>& pages){
+    QSaveFile file(archiveFileName);
+    if(!file.open(QIODevice::WriteOnly)){
+        qDebug() << "Failed to open archive: " << archiveFileName;
+        return false;
+    }
+    QDataStream out(&file);
+    out << (quint32)PEN_MAGIC << (quint32)PEN_VERSION << (quint64)0;
+    QList<QList<ArchiveFrame>> frames;
+    // same frames are written once, by codec and content hash
+    QHash<QByteArray, ArchiveFrame> written;
+    for(const ArchivePage &page : pages){
+        QList<ArchiveFrame> list;
+        for(int j = 0; j < page.encoded.size(); j++){
+            const QByteArray &data = page.encoded[j];
+            QByteArray hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+            hash.prepend((char)page.codecs[j]);
+            if(!written.contains(hash)){
+                ArchiveFrame frame;
+                frame.codec = page.codecs[j];
+                frame.offset = file.pos();
+                frame.size = data.size();
+                out.writeRawData(data.constData(), data.size());
+                written[hash] = frame;
+            }
+            list.append(written[hash]);
+        }
+        frames.append(list);
+    }
+    quint64 index = file.pos();
+    out << (quint32)pages.size();
+    for(int i = 0; i < pages.size(); i++){
+        const ArchivePage &page = pages[i];
+        out << (qint32)page.type << (qint32)page.overlay;
+        out << (qint32)page.size.width() << (qint32)page.size.height();
+        out << (quint32)frames[i].size();
+        for(const ArchiveFrame &frame : frames[i]){
+            out << frame.codec << frame.offset << frame.size;
+        }
+    }
+    file.seek(8);
+    out << index;
+    if(out.status() != QDataStream::Ok){
+        file.cancelWriting();
+    }
+    return file.commit();
+}
+
+// reads the rest of the entry into data which has the size of the entry
+static bool readEntry(struct archive *ar, char *data, la_int64_t size){
+    la_int64_t done = 0;
+    while(done < size){
+        la_ssize_t len = archive_read_data(ar, data + done, size - done);
+        if(len <= 0){
+            return false;
+        }
+        done += len;
+    }
+    return true;
+}
+
+static QList<ArchivePage> load_v1(const QString& archiveFileName) {
+    QMap<int, QMap<int, QByteArray>> values;
+    QList<ArchivePage> pages;
+    // Open the archive file
+    struct archive *ar;
+    struct archive_entry *entry;
+    ar = archive_read_new();
+    archive_read_support_filter_all(ar);
+    archive_read_support_format_all(ar);
+    int r = archive_read_open_filename(ar, archiveFileName.toStdString().c_str(), 10240); // 10240 is the block size
+    if (r != ARCHIVE_OK) {
+        qDebug() << "Failed to open archive: " << archive_error_string(ar);
         archive_read_free(ar);
-        return values;
+        return pages;
+    }
+    int width = screenWidth;
+    int height = screenHeight;
+    // frames are rescaled and encoded on the pool while the next ones
+    // are read, so only the frames in flight are kept dense.
+    // deque keeps them in place while it grows
+    QThreadPool pool;
+    std::deque<QImage> frames;
+    std::deque<QByteArray> encoded;
+    QList<QPair<int, int>> keys;
+    while (archive_read_next_header(ar, &entry) == ARCHIVE_OK) {
+        const char* entryName = archive_entry_pathname(entry);
+        if (!entryName) {
+            break;
+        }
+        la_int64_t size = archive_entry_size(entry);
+        if(strcmp(entryName, "config") == 0){
+            // checked before the buffer is allocated
+            if(size < 0 || size > 64){
+                archive_read_data_skip(ar);
+                continue;
+            }
+            QByteArray config(size, 0);
+            if(!readEntry(ar, config.data(), size)){
+                continue;
+            }
+            QStringList res = QString::fromUtf8(config).split("x");
+            width = res[0].toInt();
+            height = res.value(1).toInt();
+            continue;
+        }
+        // frames are raw ARGB32 rows without padding,
+        // so they are read straight into the image
+        if(width <= 0 || height <= 0 || width > PEN_MAX_SIZE || height > PEN_MAX_SIZE
+            || size != (la_int64_t)width * height * (la_int64_t)sizeof(QRgb)){
+            printf("Invalid frame: %s\n", entryName);
+            archive_read_data_skip(ar);
+            continue;
+        }
+        QImage image(width, height, QImage::Format_ARGB32);
+        if (image.isNull() || image.sizeInBytes() != size
+            || !readEntry(ar, reinterpret_cast<char*>(image.bits()), size)) {
+            puts("Image load fail");
+            continue;
+        }
+        QStringList parts = QString(entryName).split("/");
+        keys.append(QPair<int, int>(parts[0].toInt(), parts.value(1).toInt()));
+        frames.push_back(image);
+        encoded.push_back(QByteArray());
+        QImage *frame = &frames.back();
+        QByteArray *data = &encoded.back();
+        pool_start(&pool, [frame, data](){
+            *data = archive_encode(fitScreen(*frame), QImage());
+            *frame = QImage();
+        });
+    }
+    // Close the archive
+    archive_read_close(ar);
+    archive_read_free(ar);
+    pool.waitForDone();
+    // entries are sorted as text, sort frames by number
+    for(int i = 0; i < keys.size(); i++){
+        values[keys[i].first][keys[i].second] = encoded[i];
+    }
+    if(!values.isEmpty()){
+        // empty pages do not have entries
+        for(int i = 0; i <= values.lastKey(); i++){
+            ArchivePage page;
+            page.size = QSize(screenWidth, screenHeight);
+            page.encoded = values.value(i).values();
+            for(int j = 0; j < page.encoded.size(); j++){
+                page.codecs.append(CODEC_TILES);
+            }
+            pages.append(page);
+        }
     }
+    return pages;
+}
 
-private:
-    QMap<QString, QImage> values;
-};
+QSharedPointer<ArchiveFile> archive_open(const QString& archiveFileName) {
+    QSharedPointer<ArchiveFile> archive(new ArchiveFile());
+    archive->name = archiveFileName;
+    QFile &file = archive->file;
+    file.setFileName(archiveFileName);
+    if(!file.open(QIODevice::ReadOnly)){
+        qDebug() << "Failed to open archive: " << archiveFileName;
+        return archive;
+    }
+    QDataStream in(&file);
+    quint32 magic, version;
+    quint64 index;
+    in >> magic;
+    if(magic != PEN_MAGIC){
+        // old files do not have an index, they are encoded at once
+        file.close();
+        archive->pages = load_v1(archiveFileName);
+        return archive;
+    }
+    in >> version >> index;
+    if(version != PEN_VERSION || !file.seek(index)){
+        qDebug() << "Unsupported archive: " << archiveFileName;
+        return archive;
+    }
+    quint32 count;
+    in >> count;
+    QList<ArchivePage> pages;
+    QList<QList<ArchiveFrame>> frames;
+    for(quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++){
+        ArchivePage page;
+        qint32 type, overlay, width, height;
+        quint32 frameCount;
+        in >> type >> overlay >> width >> height >> frameCount;
+        if(width <= 0 || height <= 0 || width > PEN_MAX_SIZE || height > PEN_MAX_SIZE){
+            qDebug() << "Invalid page size: " << width << height;
+            return archive;
+        }
+        page.type = type;
+        page.overlay = overlay;
+        page.size = QSize(width, height);
+        QList<ArchiveFrame> list;
+        for(quint32 j = 0; j < frameCount && in.status() == QDataStream::Ok; j++){
+            ArchiveFrame frame;
+            in >> frame.codec >> frame.offset >> frame.size;
+            list.append(frame);
+        }
+        pages.append(page);
+        frames.append(list);
+    }
+    if(in.status() != QDataStream::Ok){
+        qDebug() << "Broken archive index: " << archiveFileName;
+        return archive;
+    }
+    archive->pages = pages;
+    archive->index = frames;
+    return archive;
+}
 
-ArchiveStorage archive;
+int ArchiveFile::frameCount(int page) const {
+    if(page < 0 || page >= pages.size()){
+        return 0;
+    }
+    if(page < index.size()){
+        return index[page].size();
+    }
+    return pages[page].encoded.size();
+}
 
-void archive_add(const QString& path, const QImage& image){
-    archive.add(path, image);
+int ArchiveFile::codec(int page, int num) const {
+    if(num < 0 || num >= frameCount(page)){
+        return CODEC_TILES;
+    }
+    if(page >= index.size()){
+        return pages[page].codecs[num];
+    }
+    return index[page][num].codec;
 }
 
-void archive_create(const QString& archiveFileName){
-    archive.create(archiveFileName);
+QImage ArchiveFile::frame(int page, int num) const {
+    if(num < 0 || num >= frameCount(page)){
+        return QImage();
+    }
+    // deltas are drawn on the last complete frame before
+    int first = num;
+    while(first > 0 && codec(page, first) == CODEC_DELTA){
+        first--;
+    }
+    QImage image = emptyFrame(pages[page].size);
+    for(int i = first; i <= num; i++){
+        if(!applyTiles(qUncompress(raw(page, i)), image)){
+            puts("Image load fail");
+            return QImage();
+        }
+    }
+    return fitScreen(image);
+}
+
+QByteArray ArchiveFile::raw(int page, int num) const {
+    if(num < 0 || num >= frameCount(page)){
+        return QByteArray();
+    }
+    if(page >= index.size()){
+        return pages[page].encoded[num];
+    }
+    const ArchiveFrame &frame = index[page][num];
+    QMutexLocker locker(&lock);
+    if(!file.seek(frame.offset)){
+        return QByteArray();
+    }
+    QByteArray data = file.read(frame.size);
+    if((quint32)data.size() != frame.size){
+        return QByteArray();
+    }
+    return data;
 }
 
-QMap<QString, QImage> archive_load(const QString& archiveFileName) {
-    return archive.load(archiveFileName);
+QVector<QImage> ArchiveFile::frames(int page) const {
+    QVector<QImage> images(frameCount(page));
+    // One reader, frames are uncompressed on all cores.
+    // Deltas are drawn in order after that, then frames are rescaled.
+    QThreadPool pool;
+    QSize size = pages[page].size;
+    QVector<QByteArray> tiles(images.size());
+    QVector<bool> valid(images.size());
+    for(int i = 0; i < images.size(); i++){
+        QByteArray data = raw(page, i);
+        QByteArray *list = &tiles[i];
+        QImage *image = &images[i];
+        bool *ok = &valid[i];
+        bool complete = codec(page, i) != CODEC_DELTA;
+        pool_start(&pool, [data, list, image, ok, complete, size](){
+            *list = qUncompress(data);
+            if(complete){
+                *image = emptyFrame(size);
+                *ok = applyTiles(*list, *image);
+            }
+        });
+    }
+    pool.waitForDone();
+    for(int i = 0; i < images.size(); i++){
+        if(codec(page, i) == CODEC_DELTA){
+            images[i] = i > 0 && !images[i-1].isNull() ? images[i-1].copy() : emptyFrame(size);
+            valid[i] = applyTiles(tiles[i], images[i]);
+        }
+    }
+    for(int i = 0; i < images.size(); i++){
+        if(!valid[i]){
+            puts("Image load fail");
+        }
+        QImage *image = &images[i];
+        pool_start(&pool, [image](){
+            *image = fitScreen(*image);
+        });
+    }
+    pool.waitForDone();
+    return images;
 }
@@ -1,9 +1,74 @@
 #ifndef _ARCHIVE_H
 #define _ARCHIVE_H
 #include <QImage>
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QSize>
 #include <QString>
-void archive_add(const QString& path, const QImage& image);
-void archive_create(const QString& archiveFileName);
-QMap<QString, QImage> archive_load(const QString& archiveFileName) ;
+#include <QVector>
+
+#include <functional>
+
+// codecs of the frames in .pen files
+#define CODEC_TILES 0
+#define CODEC_DELTA 1
+// at most this many frames are decoded to show one frame,
+// a CODEC_TILES frame is written after KEYFRAME_INTERVAL - 1 deltas
+#define KEYFRAME_INTERVAL 8
+
+// page of a saved file, frames are the history of the page
+// type and overlay are -1 when the file does not have them
+class ArchivePage {
+public:
+    int type = -1;
+    int overlay = -1;
+    QSize size;
+    // frames encoded by archive_encode, with their codecs
+    QList<QByteArray> encoded;
+    QList<quint8> codecs;
+};
+
+class ArchiveFrame {
+public:
+    quint8 codec = 0;
+    quint64 offset = 0;
+    quint32 size = 0;
+};
+
+// Opened file, only the index is read when it is opened.
+// Frames are decoded when they are asked for.
+// The file is kept open, so it can be read after it is saved over.
+class ArchiveFile {
+public:
+    QString name;
+    // old files without an index are encoded when they are opened,
+    // their frames are kept in encoded
+    QList<ArchivePage> pages;
+    QList<QList<ArchiveFrame>> index;
+    int frameCount(int page) const;
+    QImage frame(int page, int num) const;
+    // all frames of the page, decoded in parallel
+    QVector<QImage> frames(int page) const;
+    // encoded frame as it is in the file
+    QByteArray raw(int page, int num) const;
+    int codec(int page, int num) const;
+private:
+    friend QSharedPointer<ArchiveFile> archive_open(const QString& archiveFileName);
+    mutable QFile file;
+    mutable QMutex lock;
+};
+
+// progress is called from the encoder threads
+typedef std::function<void(int done, int total)> ArchiveProgress;
+
+QSharedPointer<ArchiveFile> archive_open(const QString& archiveFileName);
+// Tile list of the frame, CODEC_DELTA against previous when it is
+// not null, CODEC_TILES otherwise. Frames are encoded one by one,
+// so the caller decides how many full images are kept at once.
+QByteArray archive_encode(const QImage &frame, const QImage &previous);
+// writes the encoded frames of the pages
+bool archive_save(const QString& archiveFileName, const QList<ArchivePage>& pages);
 
 #endif
@@ -0,0 +1,401 @@
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BRUSH_X86
+#endif
+
+#include "Brush.h"
+
+/*
+A line is a capsule: the pixels closer than the radius to the segment.
+The radius changes linearly from one end to the other, so the width
+of a polyline does not step at its samples.
+Coverage of a pixel is radius + 0.5 - distance of its center, clamped
+to 0..1, which is close to the antialiasing of QPainter.
+Fully covered pixels are stored in blocks, only the edge is blended.
+Masks keep the highest coverage of the lines drawn on them, so the
+overlapping caps of translucent strokes are composited only once.
+Polylines are drawn on a mask the same way and blended on the image
+in one pass, the joins of their lines are not blended twice.
+*/
+
+class BrushRow {
+public:
+    // QRgb pixels or mask bytes
+    uchar *line;
+    // pixel center relative to the start of the segment
+    float wy;
+    float ax;
+    float dx;
+    float dy;
+    float invLength;
+    // radius + 0.5 at the start, and its change to the end
+    float limit;
+    float taper;
+    QRgb color;
+    bool clear;
+};
+
+typedef void (*BrushSpan)(const BrushRow &row, int x, int end);
+
+static inline void blendPixel(QRgb &dst, float coverage, QRgb color, bool clear){
+    if(coverage <= 0){
+        return;
+    }
+    if(coverage >= 1){
+        dst = clear ? 0 : color;
+        return;
+    }
+    int c = coverage * 255 + 0.5f;
+    // blended premultiplied, like QPainter does on ARGB32
+    QRgb d = qPremultiply(dst);
+    QRgb s = clear ? 0 : qPremultiply(color);
+    QRgb out = qRgba(
+        (qRed(s) * c + qRed(d) * (255 - c)) / 255,
+        (qGreen(s) * c + qGreen(d) * (255 - c)) / 255,
+        (qBlue(s) * c + qBlue(d) * (255 - c)) / 255,
+        (qAlpha(s) * c + qAlpha(d) * (255 - c)) / 255);
+    dst = qAlpha(out) == 0 ? 0 : qUnpremultiply(out);
+}
+
+static inline float coverageAt(const BrushRow &row, int x){
+    float wx = x + 0.5f - row.ax;
+    float t = (wx * row.dx + row.wy * row.dy) * row.invLength;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+    float qx = wx - t * row.dx;
+    float qy = row.wy - t * row.dy;
+    return row.limit + t * row.taper - sqrtf(qx * qx + qy * qy);
+}
+
+static void spanScalar(const BrushRow &row, int x, int end){
+    QRgb *line = reinterpret_cast<QRgb*>(row.line);
+    for(; x < end; x++){
+        blendPixel(line[x], coverageAt(row, x), row.color, row.clear);
+    }
+}
+
+static void maskScalar(const BrushRow &row, int x, int end){
+    for(; x < end; x++){
+        float coverage = coverageAt(row, x);
+        coverage = coverage < 0 ? 0 : (coverage > 1 ? 1 : coverage);
+        uchar c = coverage * 255 + 0.5f;
+        row.line[x] = qMax(row.line[x], c);
+    }
+}
+
+#ifdef BRUSH_X86
+__attribute__((target("sse2")))
+static void spanSse2(const BrushRow &row, int x, int end){
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 ax = _mm_set1_ps(row.ax - 0.5f);
+    const __m128 dx = _mm_set1_ps(row.dx);
+    const __m128 dy = _mm_set1_ps(row.dy);
+    const __m128 wy = _mm_set1_ps(row.wy);
+    const __m128 inv = _mm_set1_ps(row.invLength);
+    const __m128 limit = _mm_set1_ps(row.limit);
+    const __m128 taper = _mm_set1_ps(row.taper);
+    const __m128i fill = _mm_set1_epi32(row.clear ? 0 : row.color);
+    const __m128 ywy = _mm_mul_ps(wy, dy);
+    QRgb *line = reinterpret_cast<QRgb*>(row.line);
+    for(; x + 4 <= end; x += 4){
+        __m128 wx = _mm_sub_ps(_mm_cvtepi32_ps(_mm_setr_epi32(x, x + 1, x + 2, x + 3)), ax);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(wx, dx), ywy), inv);
+        t = _mm_min_ps(_mm_max_ps(t, zero), one);
+        __m128 qx = _mm_sub_ps(wx, _mm_mul_ps(t, dx));
+        __m128 qy = _mm_sub_ps(wy, _mm_mul_ps(t, dy));
+        __m128 cov = _mm_sub_ps(_mm_add_ps(limit, _mm_mul_ps(t, taper)), _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(qx, qx), _mm_mul_ps(qy, qy))));
+        if(_mm_movemask_ps(_mm_cmpge_ps(cov, one)) == 0xf){
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(line + x), fill);
+            continue;
+        }
+        if(_mm_movemask_ps(_mm_cmple_ps(cov, zero)) == 0xf){
+            continue;
+        }
+        float c[4];
+        _mm_storeu_ps(c, cov);
+        for(int i = 0; i < 4; i++){
+            blendPixel(line[x + i], c[i], row.color, row.clear);
+        }
+    }
+    spanScalar(row, x, end);
+}
+
+__attribute__((target("avx2")))
+static void spanAvx2(const BrushRow &row, int x, int end){
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 ax = _mm256_set1_ps(row.ax - 0.5f);
+    const __m256 dx = _mm256_set1_ps(row.dx);
+    const __m256 dy = _mm256_set1_ps(row.dy);
+    const __m256 wy = _mm256_set1_ps(row.wy);
+    const __m256 inv = _mm256_set1_ps(row.invLength);
+    const __m256 limit = _mm256_set1_ps(row.limit);
+    const __m256 taper = _mm256_set1_ps(row.taper);
+    const __m256i fill = _mm256_set1_epi32(row.clear ? 0 : row.color);
+    const __m256 ywy = _mm256_mul_ps(wy, dy);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    QRgb *line = reinterpret_cast<QRgb*>(row.line);
+    for(; x + 8 <= end; x += 8){
+        __m256 wx = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x), lanes)), ax);
+        __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(wx, dx), ywy), inv);
+        t = _mm256_min_ps(_mm256_max_ps(t, zero), one);
+        __m256 qx = _mm256_sub_ps(wx, _mm256_mul_ps(t, dx));
+        __m256 qy = _mm256_sub_ps(wy, _mm256_mul_ps(t, dy));
+        __m256 cov = _mm256_sub_ps(_mm256_add_ps(limit, _mm256_mul_ps(t, taper)), _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(qx, qx), _mm256_mul_ps(qy, qy))));
+        if(_mm256_movemask_ps(_mm256_cmp_ps(cov, one, _CMP_GE_OQ)) == 0xff){
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(line + x), fill);
+            continue;
+        }
+        if(_mm256_movemask_ps(_mm256_cmp_ps(cov, zero, _CMP_LE_OQ)) == 0xff){
+            continue;
+        }
+        float c[8];
+        _mm256_storeu_ps(c, cov);
+        for(int i = 0; i < 8; i++){
+            blendPixel(line[x + i], c[i], row.color, row.clear);
+        }
+    }
+    spanSse2(row, x, end);
+}
+
+__attribute__((target("sse2")))
+static void maskSse2(const BrushRow &row, int x, int end){
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 scale = _mm_set1_ps(255);
+    const __m128 round = _mm_set1_ps(0.5f);
+    const __m128 ax = _mm_set1_ps(row.ax - 0.5f);
+    const __m128 dx = _mm_set1_ps(row.dx);
+    const __m128 dy = _mm_set1_ps(row.dy);
+    const __m128 wy = _mm_set1_ps(row.wy);
+    const __m128 inv = _mm_set1_ps(row.invLength);
+    const __m128 limit = _mm_set1_ps(row.limit);
+    const __m128 taper = _mm_set1_ps(row.taper);
+    const __m128 ywy = _mm_mul_ps(wy, dy);
+    for(; x + 4 <= end; x += 4){
+        __m128 wx = _mm_sub_ps(_mm_cvtepi32_ps(_mm_setr_epi32(x, x + 1, x + 2, x + 3)), ax);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(wx, dx), ywy), inv);
+        t = _mm_min_ps(_mm_max_ps(t, zero), one);
+        __m128 qx = _mm_sub_ps(wx, _mm_mul_ps(t, dx));
+        __m128 qy = _mm_sub_ps(wy, _mm_mul_ps(t, dy));
+        __m128 cov = _mm_sub_ps(_mm_add_ps(limit, _mm_mul_ps(t, taper)), _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(qx, qx), _mm_mul_ps(qy, qy))));
+        if(_mm_movemask_ps(_mm_cmple_ps(cov, zero)) == 0xf){
+            continue;
+        }
+        cov = _mm_min_ps(_mm_max_ps(cov, zero), one);
+        __m128i c = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(cov, scale), round));
+        c = _mm_packus_epi16(_mm_packs_epi32(c, c), c);
+        int old;
+        memcpy(&old, row.line + x, 4);
+        int value = _mm_cvtsi128_si32(_mm_max_epu8(c, _mm_cvtsi32_si128(old)));
+        memcpy(row.line + x, &value, 4);
+    }
+    maskScalar(row, x, end);
+}
+
+__attribute__((target("avx2")))
+static void maskAvx2(const BrushRow &row, int x, int end){
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 scale = _mm256_set1_ps(255);
+    const __m256 round = _mm256_set1_ps(0.5f);
+    const __m256 ax = _mm256_set1_ps(row.ax - 0.5f);
+    const __m256 dx = _mm256_set1_ps(row.dx);
+    const __m256 dy = _mm256_set1_ps(row.dy);
+    const __m256 wy = _mm256_set1_ps(row.wy);
+    const __m256 inv = _mm256_set1_ps(row.invLength);
+    const __m256 limit = _mm256_set1_ps(row.limit);
+    const __m256 taper = _mm256_set1_ps(row.taper);
+    const __m256 ywy = _mm256_mul_ps(wy, dy);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for(; x + 8 <= end; x += 8){
+        __m256 wx = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x), lanes)), ax);
+        __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(wx, dx), ywy), inv);
+        t = _mm256_min_ps(_mm256_max_ps(t, zero), one);
+        __m256 qx = _mm256_sub_ps(wx, _mm256_mul_ps(t, dx));
+        __m256 qy = _mm256_sub_ps(wy, _mm256_mul_ps(t, dy));
+        __m256 cov = _mm256_sub_ps(_mm256_add_ps(limit, _mm256_mul_ps(t, taper)), _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(qx, qx), _mm256_mul_ps(qy, qy))));
+        if(_mm256_movemask_ps(_mm256_cmp_ps(cov, zero, _CMP_LE_OQ)) == 0xff){
+            continue;
+        }
+        cov = _mm256_min_ps(_mm256_max_ps(cov, zero), one);
+        __m256i c = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(cov, scale), round));
+        __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1));
+        __m128i bytes = _mm_packus_epi16(words, words);
+        __m128i old = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row.line + x));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(row.line + x), _mm_max_epu8(bytes, old));
+    }
+    maskSse2(row, x, end);
+}
+#endif
+
+class BrushKernel {
+public:
+    BrushSpan color;
+    BrushSpan mask;
+};
+
+static BrushKernel brushKernel(){
+#ifdef BRUSH_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        return {spanAvx2, maskAvx2};
+    }
+    if(__builtin_cpu_supports("sse2")){
+        return {spanSse2, maskSse2};
+    }
+#endif
+    return {spanScalar, maskScalar};
+}
+
+static const BrushKernel &kernel(){
+    static const BrushKernel kernel = brushKernel();
+    return kernel;
+}
+
+bool brush_supports(const QImage &image){
+    return image.format() == QImage::Format_ARGB32;
+}
+
+// x range of a row which can be covered, the end caps and the band
+// around the line have all pixels of the capsule
+static void rowRange(const BrushRow &row, float ay, float yc, float radius, float &left, float &right){
+    float bx = row.ax + row.dx;
+    float by = ay + row.dy;
+    left = qMax(qMin(row.ax, bx) - radius, left);
+    right = qMin(qMax(row.ax, bx) + radius, right);
+    if(fabsf(row.dy) < 1e-3f){
+        // horizontal, the whole box
+        return;
+    }
+    float centre = row.ax + (yc - ay) * row.dx / row.dy;
+    float half = radius * sqrtf(1 / row.invLength) / fabsf(row.dy);
+    float from = centre - half, to = centre + half;
+    float cy[2] = {ay, by};
+    float cx[2] = {row.ax, bx};
+    for(int i = 0; i < 2; i++){
+        float h = radius * radius - (yc - cy[i]) * (yc - cy[i]);
+        if(h >= 0){
+            h = sqrtf(h);
+            from = qMin(from, cx[i] - h);
+            to = qMax(to, cx[i] + h);
+        }
+    }
+    left = qMax(left, from);
+    right = qMin(right, to);
+}
+
+static void capsule(QImage &image, const QPointF &from, const QPointF &to, qreal fromWidth, qreal toWidth, BrushRow &row, BrushSpan span){
+    float start = qMax(fromWidth / 2, (qreal)0.5);
+    float end = qMax(toWidth / 2, (qreal)0.5);
+    float radius = qMax(start, end);
+    row.ax = from.x();
+    row.dx = to.x() - from.x();
+    row.dy = to.y() - from.y();
+    float length = row.dx * row.dx + row.dy * row.dy;
+    if(length < 1e-6f){
+        row.dx = row.dy = 0;
+        length = 1;
+    }
+    row.invLength = 1 / length;
+    row.limit = start + 0.5f;
+    row.taper = end - start;
+    float ay = from.y();
+    float reach = radius + 1;
+    int top = qMax(0, (int)floorf(qMin(from.y(), to.y()) - reach));
+    int bottom = qMin(image.height() - 1, (int)ceilf(qMax(from.y(), to.y()) + reach));
+    for(int y = top; y <= bottom; y++){
+        float yc = y + 0.5f;
+        float left = 0, right = image.width();
+        row.wy = yc - ay;
+        rowRange(row, ay, yc, reach, left, right);
+        int x = qMax(0, (int)floorf(left));
+        int end = qMin(image.width(), (int)ceilf(right) + 1);
+        if(x >= end){
+            continue;
+        }
+        row.line = image.scanLine(y);
+        span(row, x, end);
+    }
+}
+
+void brush_line(QImage &image, const QPointF &from, const QPointF &to, qreal fromWidth, qreal toWidth, QRgb color, bool clear){
+    BrushRow row;
+    row.color = color;
+    row.clear = clear;
+    capsule(image, from, to, fromWidth, toWidth, row, kernel().color);
+}
+
+void brush_polyline(QImage &image, const QVector<QPointF> &points, const QVector<qreal> &widths, QRgb color, bool clear){
+    if(points.size() < 2 || widths.size() != points.size()){
+        return;
+    }
+    // coverage of the outline is collected on a mask of its box
+    qreal left = points[0].x(), right = left;
+    qreal top = points[0].y(), bottom = top;
+    qreal reach = 0;
+    for(int i = 0; i < points.size(); i++){
+        left = qMin(left, points[i].x());
+        right = qMax(right, points[i].x());
+        top = qMin(top, points[i].y());
+        bottom = qMax(bottom, points[i].y());
+        reach = qMax(reach, qMax(widths[i] / 2, (qreal)0.5));
+    }
+    reach += 2;
+    QRect box = QRectF(QPointF(left - reach, top - reach), QPointF(right + reach, bottom + reach))
+        .toAlignedRect().intersected(image.rect());
+    if(box.isEmpty()){
+        return;
+    }
+    QImage mask(box.size(), QImage::Format_Alpha8);
+    mask.fill(0);
+    for(int i = 1; i < points.size(); i++){
+        brush_mask(mask, points[i-1] - box.topLeft(), points[i] - box.topLeft(), widths[i-1], widths[i]);
+    }
+    QRgb fill = clear ? 0 : color;
+    for(int y = 0; y < box.height(); y++){
+        const uchar *coverage = mask.constScanLine(y);
+        QRgb *line = reinterpret_cast<QRgb*>(image.scanLine(box.y() + y)) + box.x();
+        for(int x = 0; x < box.width(); x++){
+            if(coverage[x] == 255){
+                line[x] = fill;
+            } else if(coverage[x] != 0){
+                blendPixel(line[x], coverage[x] / 255.0f, color, clear);
+            }
+        }
+    }
+}
+
+void brush_mask(QImage &mask, const QPointF &from, const QPointF &to, qreal fromWidth, qreal toWidth){
+    BrushRow row;
+    row.color = 0;
+    row.clear = false;
+    capsule(mask, from, to, fromWidth, toWidth, row, kernel().mask);
+}
+
+void brush_composite(QImage &image, const QImage &mask, const QPoint &offset, const QRect &rect, QRgb color){
+    QRect r = rect.intersected(image.rect()).intersected(mask.rect().translated(offset));
+    int alpha = qAlpha(color);
+    for(int y = r.top(); y <= r.bottom(); y++){
+        QRgb *line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        const uchar *coverage = mask.constScanLine(y - offset.y()) - offset.x();
+        for(int x = r.left(); x <= r.right(); x++){
+            int a = (alpha * coverage[x] + 127) / 255;
+            if(a == 0){
+                continue;
+            }
+            // source over, on unpremultiplied pixels
+            QRgb d = line[x];
+            int da = qAlpha(d) * (255 - a) / 255;
+            int oa = a + da;
+            line[x] = qRgba(
+                (qRed(color) * a + qRed(d) * da) / oa,
+                (qGreen(color) * a + qGreen(d) * da) / oa,
+                (qBlue(color) * a + qBlue(d) * da) / oa,
+                oa);
+        }
+    }
+}
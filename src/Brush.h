@@ -0,0 +1,27 @@
+#ifndef BRUSH_H
+#define BRUSH_H
+
+#include <QImage>
+#include <QPoint>
+#include <QPointF>
+#include <QRect>
+#include <QVector>
+
+// Antialiased round brush which is drawn straight into the rows
+// of an ARGB32 image. Pixels are replaced by the color like
+// CompositionMode_Source, or cleared like CompositionMode_Clear.
+// The inner loop uses AVX2 or SSE2 when the CPU has them.
+bool brush_supports(const QImage &image);
+// the width changes linearly from the start of the line to the end
+void brush_line(QImage &image, const QPointF &from, const QPointF &to, qreal fromWidth, qreal toWidth, QRgb color, bool clear);
+// Polyline with a width at every point. The outline is the union of the
+// tapered lines, it is filled at once: every pixel is blended once
+// with the highest coverage of the lines over it.
+void brush_polyline(QImage &image, const QVector<QPointF> &points, const QVector<qreal> &widths, QRgb color, bool clear);
+// line on an Alpha8 mask, pixels keep the highest coverage
+void brush_mask(QImage &mask, const QPointF &from, const QPointF &to, qreal fromWidth, qreal toWidth);
+// color over the image in rect with its alpha times the coverage of the mask,
+// the mask is at offset on the image
+void brush_composite(QImage &image, const QImage &mask, const QPoint &offset, const QRect &rect, QRgb color);
+
+#endif // BRUSH_H
@@ -1,5 +1,9 @@
 #include "DrawingWidget.h"
 #include "WhiteBoard.h"
+#include "Stroke.h"
+#include "StrokeIndex.h"
+#include "Journal.h"
+#include "Pool.h"
 #ifdef LIBARCHIVE
 #include "Archive.h"
 #endif
@@ -21,6 +25,10 @@ extern WhiteBoard *board;
 extern DrawingWidget *window;
 
 extern void updateGoBackButtons();
+#ifdef LIBARCHIVE
+extern void updateSaveProgress(int percent);
+extern void saveFinished(const QString &file, bool ok);
+#endif
 void removeDirectory(const QString &path);
 
 int screenWidth = 0;
@@ -36,17 +44,34 @@ penType:
 */
 
 #include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QMap>
+#include <QPair>
+#include <QSemaphore>
+#include <QStandardPaths>
+#include <QTemporaryFile>
+#include <QtMath>
 
 #ifdef QT5
 #define points touchPoints
 #define position pos
 #endif
 
+// number of frames per page in saved files
 #ifndef HISTORY
 #define HISTORY 15
 #endif
 
+#define CHECKPOINT 32
+
+#define POINTER_MOUSE -1
+#define POINTER_TABLET -2
+
+// ids of committed strokes and page bases
+QAtomicInteger<quint64> strokeSerial = 0;
+
 class ValueStorage {
 public:
     void saveValue(qint64 id, QPointF data) {
@@ -73,111 +98,793 @@ public:
     int image_count = 0;
     int pageType = TRANSPARENT;
     int overlayType = NONE;
-    int removed = 0;
-    void saveValue(qint64 id, QImage data) {
-        values[id] = data;
+    // Frames of the page before the first frame of the last saved file,
+    // the journal counts frames and erased strokes from the saved ones.
+    int journalOffset = 0;
+
+    // The page is a stroke log on top of the base tiles.
+    // Frame N is the base with the first N-1 strokes.
+
+    // new samples of another pen need a new stroke,
+    // freehand samples are never merged into a shape or an erase entry
+    bool accepts(const Stroke &pen) {
+        return pending.isEmpty() || (!pending.isErase() && pending.samePen(pen));
+    }
+
+    Stroke& record(const Stroke &pen) {
+        if(pending.isEmpty() || pending.penStyle != SPLINE){
+            pending.penType = pen.penType;
+            pending.penStyle = pen.penStyle;
+            pending.color = pen.color;
+            pending.size = pen.size;
+        }
+        return pending;
+    }
+
+    QRegion paint(QImage &canvas, const Stroke &batch) {
+        return stroke_draw(canvas, batch, &dirty, 0, &layer);
+    }
+
+    QRegion commit(QImage &canvas) {
+        QRegion region;
+        if(pending.isEmpty()){
+            return region;
+        }
+        if(pending.penStyle != SPLINE){
+            // shapes are only previewed while dragging
+            region = stroke_draw(canvas, pending, &dirty);
+        }
+        discard();
+        pending.id = ++strokeSerial;
+        strokes.append(pending);
+        index.insert(strokes.size() - 1, stroke_bounds(canvas, pending).boundingRect());
+        pending = Stroke();
+        layer.clear();
+        last_image_num++;
+        image_count = last_image_num;
+        checkpoint(canvas);
         updateGoBackButtons();
-        if(id > HISTORY){
-            remove(id-HISTORY);
-            removed++;
+        return region;
+    }
+
+    // pending is an erase entry, see erase()
+    bool erasing() const {
+        return pending.isErase();
+    }
+
+    // Removes the strokes which the eraser line touches, the strokes
+    // of one drag are one erase entry. Only the tiles under them are
+    // painted again, returns the region changed on the canvas.
+    QRegion erase(QImage &canvas, const QPointF &start, const QPointF &end, qreal radius) {
+        int applied = last_image_num - 1;
+        QRect rect = QRectF(start, end).normalized().adjusted(-radius, -radius, radius, radius).toAlignedRect();
+        QVector<qint32> hits;
+        for(int i : index.query(rect)){
+            auto by = erasedBy.constFind(i);
+            // lines of the pixel eraser are never hit, erase entries
+            // after the frame are redo ones and the first hit drops them
+            if(i >= applied || strokes[i].penType == ERASER
+                || (by != erasedBy.constEnd() && (by.value() < applied || pending.isErase()))){
+                continue;
+            }
+            if(stroke_hit(strokes[i], start, end, radius)){
+                hits.append(i);
+            }
+        }
+        if(hits.isEmpty()){
+            return QRegion();
+        }
+        if(!pending.isErase()){
+            discard();
+            pending = Stroke();
+            pending.penType = ERASER;
+            pending.penStyle = SPLINE;
+        }
+        for(qint32 i : hits){
+            pending.erased.append(i);
+            erasedBy[i] = applied;
+        }
+        return redraw(canvas, applied, area(canvas, hits), &dirty);
+    }
+
+    // both return the region changed on the canvas
+    QRegion undo(QImage &canvas) {
+        last_image_num--;
+        rebuild(canvas);
+        return bounds(canvas, last_image_num-1);
+    }
+
+    QRegion redo(QImage &canvas) {
+        QRegion region = draw(canvas, last_image_num-1, &dirty);
+        last_image_num++;
+        checkpoint(canvas);
+        return region;
+    }
+
+    void rebuild(QImage &canvas) {
+        int applied = last_image_num - 1;
+        int from = restore(canvas, applied);
+        dirty.clear();
+        for(int i = from; i < applied; i++){
+            draw(canvas, i, &dirty);
+        }
+    }
+
+    // Writes the strokes of the log from the given one on to the journal,
+    // redo strokes too. False when the journal can not have them after
+    // the last save, nothing is written then, see journalAll().
+    bool journal(int page, int from) const {
+        for(int i = from; i < strokes.size(); i++){
+            if(i < journalOffset){
+                return false;
+            }
+            for(qint32 erased : strokes[i].erased){
+                if(erased < journalOffset){
+                    return false;
+                }
+            }
+        }
+        for(int i = from; i < strokes.size(); i++){
+            Stroke stroke = strokes[i];
+            for(qint32 &erased : stroke.erased){
+                erased -= journalOffset;
+            }
+            journal_stroke(page, i + 1 - journalOffset, pageType, overlayType, stroke);
+        }
+        return true;
+    }
+
+    // Writes the page from scratch. Raster frames of the opened file
+    // are journaled as the tiles which the page starts from,
+    // their strokes are not counted.
+    void journalAll(int page) {
+        journalOffset = 0;
+        while(journalOffset < strokes.size() && strokes[journalOffset].samples.isEmpty()
+            && !strokes[journalOffset].isErase()){
+            journalOffset++;
+        }
+        if(journalOffset > 0 || !base.isEmpty()){
+            journal_base(page, TileDelta::sparse(loadValue(journalOffset + 1)));
+        } else {
+            journal_clear(page);
+        }
+        journal(page, journalOffset);
+        journal_frame(page, qMax(1, last_image_num - journalOffset));
+    }
+
+    // Journals the page again after it is saved to a file which has
+    // the saved frames of it. Frames which are not changed since then
+    // are taken from the file. False when nothing is written and the
+    // page has to be journaled from scratch, see journalAll().
+    bool rebase(int page, const ImageStorage *saved) {
+        int count = saved ? saved->image_count : 0;
+        int offset = qMax(1, count - HISTORY + 1) - 1;
+        int same = 0;
+        for(int num = qMin(count, (int)strokes.size() + 1); num > offset; num--){
+            if(frameKey(num) == saved->frameKey(num)){
+                same = num;
+                break;
+            }
+        }
+        int old = journalOffset;
+        journalOffset = offset;
+        if(same == 0 || !journal(page, same - 1)){
+            journalOffset = old;
+            return false;
+        }
+        journal_frame(page, qMax(1, last_image_num - offset));
+        return true;
+    }
+
+    // replays a stroke which was committed on the given frame
+    void append(QImage &canvas, int frame, const Stroke &stroke) {
+        if(frame < 1 || frame > strokes.size() + 1){
+            return;
+        }
+        if(frame != last_image_num){
+            last_image_num = frame;
+            rebuild(canvas);
+        }
+        pending = stroke;
+        if(pending.isErase()){
+            discard();
+            int applied = last_image_num - 1;
+            pending.erased.clear();
+            for(qint32 i : stroke.erased){
+                if(i >= 0 && i < applied && !erasedBy.contains(i)){
+                    pending.erased.append(i);
+                    erasedBy[i] = applied;
+                }
+            }
+            redraw(canvas, applied, area(canvas, pending.erased), &dirty);
+        } else if(pending.penStyle == SPLINE){
+            stroke_draw(canvas, pending, &dirty);
+        }
+        commit(canvas);
+    }
+
+    // The canvas of the page stays valid with the returned tiles,
+    // adopt() shows it again without a rebuild.
+    TileDelta unload() {
+        TileDelta delta = dirty;
+        dirty.clear();
+        return delta;
+    }
+
+    void adopt(const TileDelta &delta) {
+        dirty = delta;
+    }
+
+#ifdef LIBARCHIVE
+    void open(QSharedPointer<ArchiveFile> archive, int page) {
+        clear();
+        int count = archive->frameCount(page);
+        if(count == 0){
+            return;
+        }
+        // frames are placeholders until they are decoded
+        source = archive;
+        sourcePage = page;
+        for(int i = 1; i < count; i++){
+            Stroke stroke;
+            stroke.id = ++strokeSerial;
+            strokes.append(stroke);
+        }
+        image_count = count;
+        last_image_num = image_count;
+        if(archive->pages[page].size == QSize(screenWidth, screenHeight)){
+            sourceFrames = count;
         }
     }
 
+    // encoded frame which is in the opened file unchanged
+    QByteArray sourceFrame(int num) {
+        if(source.isNull() || num > sourceFrames){
+            return QByteArray();
+        }
+        return source->raw(sourcePage, num - 1);
+    }
+
+    int sourceCodec(int num) {
+        return source.isNull() ? CODEC_TILES : source->codec(sourcePage, num - 1);
+    }
+#endif
+
+    // Frames with the same key have the same content,
+    // the key is the last stroke of the frame.
+    quint64 frameKey(int num) const {
+        if(num <= 1 || num - 2 >= strokes.size()){
+            return baseId;
+        }
+        return strokes[num - 2].id;
+    }
+
     void clear(){
-        values.clear();
+#ifdef LIBARCHIVE
+        source.reset();
+        decoded = false;
+        sourceFrames = 0;
+#endif
+        baseId = ++strokeSerial;
+        base.clear();
+        strokes.clear();
+        index.clear();
+        erasedBy.clear();
+        checkpoints.clear();
+        dirty.clear();
+        pending = Stroke();
+        layer.clear();
         image_count = 0;
         last_image_num = 1;
-        removed = 0;
+        journalOffset = 0;
         updateGoBackButtons();
     }
 
+    // page which starts from the tiles, see journalAll()
+    void reset(const TileDelta &tiles) {
+        clear();
+        base = tiles;
+    }
+
     QImage loadValue(qint64 id) {
-        if(removed >= id) {
-            id =  removed +1;
+        QImage image;
+        int applied = qBound((qint64)0, id - 1, (qint64)strokes.size());
+        for(int i = restore(image, applied); i < applied; i++){
+            draw(image, i, nullptr);
         }
-        if (values.contains(id)) {
-            return values[id];
-        } else {
-            QImage image = QImage(screenWidth,screenHeight, QImage::Format_ARGB32);
-            image.fill(QColor("transparent"));
-            return image;
+        return image;
+    }
+
+    // memory used by the pixels of the page
+    qint64 memory() const {
+        qint64 size = base.bytes() + dirty.bytes();
+        for(const Stroke &stroke : strokes){
+            size += stroke.tiles.bytes();
+        }
+        for(const TileDelta &delta : checkpoints){
+            size += delta.bytes();
+        }
+        return size;
+    }
+
+    // pixels of a spilled page in a snapshot, see PageStorage::snapshot()
+    QByteArray packed;
+
+    // Pixels of the page for the spill file, the rest of the page
+    // stays in memory. drop() frees them until unpack() is called.
+    QByteArray pack() const {
+        QByteArray data;
+        QDataStream out(&data, QIODevice::WriteOnly);
+        base.write(out);
+        out << (quint32)strokes.size();
+        for(const Stroke &stroke : strokes){
+            stroke.tiles.write(out);
+        }
+        out << (quint32)checkpoints.size();
+        for(auto it = checkpoints.constBegin(); it != checkpoints.constEnd(); ++it){
+            out << (qint32)it.key();
+            it.value().write(out);
+        }
+        return qCompress(data, 1);
+    }
+
+    void drop() {
+        base.clear();
+        for(Stroke &stroke : strokes){
+            stroke.tiles.clear();
+        }
+        checkpoints.clear();
+        dirty.clear();
+    }
+
+    bool unpack(const QByteArray &packed) {
+        QByteArray data = qUncompress(packed);
+        QDataStream in(data);
+        quint32 count;
+        if(!base.read(in)){
+            return false;
+        }
+        in >> count;
+        if(count != (quint32)strokes.size()){
+            return false;
+        }
+        for(Stroke &stroke : strokes){
+            stroke.tiles.read(in);
+        }
+        in >> count;
+        for(quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++){
+            qint32 key;
+            in >> key;
+            checkpoints[key].read(in);
+        }
+        return in.status() == QDataStream::Ok;
+    }
+
+private:
+    // raster under the strokes, missing tiles are transparent
+    TileDelta base;
+    quint64 baseId = 0;
+    QList<Stroke> strokes;
+    // boxes of the strokes with samples
+    StrokeIndex index;
+    // erase entry of the erased strokes
+    QHash<int, int> erasedBy;
+    // Tiles changed since the previous checkpoint, keyed by stroke count.
+    // Replay never starts more than CHECKPOINT strokes behind.
+    QMap<int, TileDelta> checkpoints;
+    // tiles touched since the last checkpoint, with the old content
+    TileDelta dirty;
+    Stroke pending;
+    // coverage of pending when it is translucent
+    StrokeLayer layer;
+#ifdef LIBARCHIVE
+    // opened file of the page
+    QSharedPointer<ArchiveFile> source;
+    int sourcePage = 0;
+    bool decoded = false;
+    // first frames which are the same as in the file
+    int sourceFrames = 0;
+
+    void fetch(int applied) {
+        if(source.isNull() || decoded){
+            return;
+        }
+        int last = source->frameCount(sourcePage) - 1;
+        if(applied >= last){
+            // the current frame is enough until history is needed
+            if(!checkpoints.contains(last)){
+                checkpoints[last] = TileDelta::sparse(source->frame(sourcePage, last));
+            }
+            return;
+        }
+        QVector<QImage> frames = source->frames(sourcePage);
+        base = TileDelta::sparse(frames[0]);
+        for(int i = 1; i <= last; i++){
+            strokes[i-1].tiles = TileDelta::diff(frames[i], frames[i-1]);
+        }
+        // later checkpoints are relative to this one
+        checkpoints[last] = TileDelta::diff(frames[last], frames[0]);
+        decoded = true;
+    }
+#endif
+
+    int restore(QImage &image, int applied) {
+#ifdef LIBARCHIVE
+        fetch(applied);
+#endif
+        // frames of the file are scaled to the screen when they are decoded
+        image = QImage(screenWidth,screenHeight, QImage::Format_ARGB32);
+        image.fill(QColor("transparent"));
+        base.apply(image);
+        int from = 0;
+        for(auto it = checkpoints.constBegin(); it != checkpoints.constEnd() && it.key() <= applied; ++it){
+            it.value().apply(image);
+            from = it.key();
+        }
+        return from;
+    }
+
+    // drops the redo strokes and what is kept for them
+    void discard() {
+        int applied = last_image_num - 1;
+        if(strokes.size() <= applied){
+            return;
+        }
+        while(strokes.size() > applied){
+            strokes.removeLast();
+        }
+        index.truncate(applied);
+        for(auto it = erasedBy.begin(); it != erasedBy.end(); ){
+            if(it.value() >= applied){
+                it = erasedBy.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        while(!checkpoints.isEmpty() && checkpoints.lastKey() > applied){
+            checkpoints.remove(checkpoints.lastKey());
+        }
+#ifdef LIBARCHIVE
+        sourceFrames = qMin(sourceFrames, applied + 1);
+#endif
+    }
+
+    // stroke is shown on the frames after the entry
+    bool shown(int stroke, int entry) const {
+        auto by = erasedBy.constFind(stroke);
+        return by == erasedBy.constEnd() || by.value() > entry;
+    }
+
+    QRegion draw(QImage &canvas, int entry, TileDelta *dirty) {
+        const Stroke &stroke = strokes[entry];
+        if(!stroke.isErase()){
+            return stroke_draw(canvas, stroke, dirty);
+        }
+        return redraw(canvas, entry, area(canvas, stroke.erased), dirty);
+    }
+
+    QRegion bounds(const QImage &canvas, int entry) const {
+        const Stroke &stroke = strokes[entry];
+        return stroke.isErase() ? area(canvas, stroke.erased) : stroke_bounds(canvas, stroke);
+    }
+
+    // tiles under the boxes of the strokes
+    QRegion area(const QImage &canvas, const QVector<qint32> &list) const {
+        QRegion region;
+        for(qint32 i : list){
+            QRect box = index.box(i).intersected(canvas.rect());
+            if(box.isEmpty()){
+                continue;
+            }
+            QPoint from(box.left() / TILE_SIZE * TILE_SIZE, box.top() / TILE_SIZE * TILE_SIZE);
+            QPoint to((box.right() / TILE_SIZE + 1) * TILE_SIZE - 1, (box.bottom() / TILE_SIZE + 1) * TILE_SIZE - 1);
+            region += QRect(from, to).intersected(canvas.rect());
         }
+        return region;
     }
 
-    void remove(qint64 id){
-        for (auto it = values.begin(); it != values.end(); ++it) {
-            if (it.key() == id) {
-                values.erase(it);
+    // Paints the region as it is after the erase entry: the base, the raster
+    // frames of the opened file and the strokes which are still shown.
+    // The strokes are drawn on a patch of the region in the order of the log.
+    QRegion redraw(QImage &canvas, int entry, const QRegion &region, TileDelta *dirty) {
+        if(region.isEmpty()){
+            return region;
+        }
+        QRect rect = region.boundingRect();
+        QImage patch(rect.size(), QImage::Format_ARGB32);
+        patch.fill(QColor("transparent"));
+        // raster strokes are the first ones, they are never erased
+        int raster = 0;
+        while(raster < entry && strokes[raster].samples.isEmpty() && !strokes[raster].isErase()){
+            raster++;
+        }
+#ifdef LIBARCHIVE
+        fetch(raster);
+#endif
+        base.apply(patch, rect);
+        int from = 0;
+        for(auto it = checkpoints.constBegin(); it != checkpoints.constEnd() && it.key() <= raster; ++it){
+            it.value().apply(patch, rect);
+            from = it.key();
+        }
+        for(int i = from; i < raster; i++){
+            strokes[i].tiles.apply(patch, rect);
+        }
+        for(int i : index.query(region)){
+            if(i >= entry){
                 break;
             }
+            if(!shown(i, entry)){
+                continue;
+            }
+            Stroke stroke = strokes[i];
+            stroke.translate(-rect.topLeft());
+            stroke_draw(patch, stroke, nullptr);
         }
+        QPainter painter(&canvas);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        for(const QRect &r : region){
+            if(dirty){
+                dirty->touch(canvas, r);
+            }
+            painter.drawImage(r, patch, r.translated(-rect.topLeft()));
+        }
+        return region;
     }
 
-private:
-    QMap<qint64, QImage> values;
+    void checkpoint(const QImage &canvas) {
+        int applied = last_image_num - 1;
+        if(applied % CHECKPOINT != 0){
+            return;
+        }
+        if(!checkpoints.contains(applied)){
+            dirty.commit(canvas);
+            dirty.capture(canvas);
+            checkpoints[applied] = dirty;
+        }
+        dirty.clear();
+    }
 };
 ImageStorage images;
 
+// place of a page in the spill file, the place is kept
+// for the next spill of the page when it is faulted in
+class SpillSlot {
+public:
+    qint64 offset = 0;
+    qint64 capacity = 0;
+    qint64 size = 0;
+    bool used = false;
+};
 
 class PageStorage {
 public:
     int last_page_num = 0;
     int page_count = 0;
+    // changes when another document is opened
+    int document = 0;
     void saveValue(qint64 id, ImageStorage data) {
         values[id] = data;
+        spillSlots[id].used = false;
+        use(id);
+        trim(id);
     }
 
     void clear(){
         values.clear();
+        spillSlots.clear();
+        recent.clear();
+        if(spill.isOpen()){
+            spill.resize(0);
+        }
         last_page_num = 0;
         page_count = 0;
     }
 #ifdef LIBARCHIVE
-    void saveAll(const QString& filename){
+    // Copies share strokes and pixels with the pages until one side
+    // changes them, so taking the snapshot is cheap. Spilled pages
+    // keep their packed pixels. Empty if a spilled page can not be read.
+    QList<ImageStorage> snapshot(){
+        images.pageType = board->getType();
+        images.overlayType = board->getOverlayType();
         values[last_page_num] = images;
+        QList<ImageStorage> list;
         for(int i=0;i<=page_count;i++){
-            for(int j=1+loadValue(i).removed;j<=loadValue(i).image_count;j++){
-                archive_add(QString::number(i)+"/"+QString::number(j-1-loadValue(i).removed), values[i].loadValue(j));
+            if(!spillSlots.value(i).used){
+                list.append(loadValue(i));
+                continue;
+            }
+            // spilled pages are unpacked by the save one by one
+            ImageStorage page = values[i];
+            page.packed = spilled(i);
+            if(page.packed.isEmpty()){
+                puts("Page load fail");
+                return QList<ImageStorage>();
+            }
+            list.append(page);
+        }
+        return list;
+    }
+
+    // Runs on the save thread, progress is frames done out of total.
+    // Frames which are in the opened file or in the last save
+    // are written as they are, only new frames are encoded.
+    // A delta can only be reused when the frame before is the same,
+    // so deltas are cached by the keys of both frames.
+    static bool saveAll(const QString& filename, QList<ImageStorage> snapshot, ArchiveProgress progress){
+        // only one save runs at a time
+        static QHash<quint64, QByteArray> savedFull;
+        static QHash<QPair<quint64, quint64>, QByteArray> savedDelta;
+        static QSize savedSize;
+        if(savedSize != QSize(screenWidth, screenHeight)){
+            savedFull.clear();
+            savedDelta.clear();
+        }
+        QList<ArchivePage> archive;
+        QList<QList<quint64>> keys;
+        int total = 0;
+        for(ImageStorage &page : snapshot){
+            ArchivePage data;
+            data.type = page.pageType;
+            data.overlay = page.overlayType;
+            data.size = QSize(screenWidth, screenHeight);
+            QList<quint64> list;
+            int first = qMax(1, page.image_count - HISTORY + 1);
+            // deltas since the last complete frame
+            int chain = 0;
+            for(int j=first;j<=page.image_count;j++){
+                quint64 key = page.frameKey(j);
+                quint8 codec = page.sourceCodec(j);
+                QByteArray encoded = page.sourceFrame(j);
+                // The first frame has to be complete. The last one is
+                // shown when the file is opened, so it is complete too,
+                // and long delta chains are cut by complete frames.
+                bool complete = j == first || j == page.image_count
+                    || chain + 1 >= KEYFRAME_INTERVAL;
+                if(complete && codec != CODEC_TILES){
+                    encoded.clear();
+                }
+                if(encoded.isEmpty() && !complete){
+                    codec = CODEC_DELTA;
+                    encoded = savedDelta.value(qMakePair(page.frameKey(j - 1), key));
+                }
+                if(encoded.isEmpty()){
+                    codec = CODEC_TILES;
+                    encoded = savedFull.value(key);
+                }
+                if(encoded.isEmpty()){
+                    // rendered and encoded below
+                    codec = complete ? CODEC_TILES : CODEC_DELTA;
+                    total++;
+                }
+                chain = codec == CODEC_DELTA ? chain + 1 : 0;
+                data.encoded.append(encoded);
+                data.codecs.append(codec);
+                list.append(key);
+            }
+            archive.append(data);
+            keys.append(list);
+        }
+        // Frames are rendered here one by one and encoded on all cores.
+        // Only a few frames are in flight, each one is freed when it is
+        // encoded, so a long document does not need all of its pixels.
+        QThreadPool pool;
+        QSemaphore window(pool.maxThreadCount());
+        QAtomicInteger<int> done = 0;
+        for(int i = 0; i < snapshot.size(); i++){
+            ImageStorage &page = snapshot[i];
+            bool spilled = !page.packed.isEmpty();
+            if(spilled && !page.unpack(page.packed)){
+                puts("Page load fail");
+                pool.waitForDone();
+                return false;
+            }
+            page.packed.clear();
+            int first = qMax(1, page.image_count - HISTORY + 1);
+            // frame before j if it is rendered
+            QImage previous;
+            for(int j=first;j<=page.image_count;j++){
+                QByteArray *data = &archive[i].encoded[j-first];
+                if(!data->isEmpty()){
+                    previous = QImage();
+                    continue;
+                }
+                // new deltas are encoded against the frame before
+                bool delta = archive[i].codecs[j-first] == CODEC_DELTA;
+                if(delta && previous.isNull()){
+                    previous = page.loadValue(j - 1);
+                }
+                QImage frame = page.loadValue(j);
+                QImage last = delta ? previous : QImage();
+                window.acquire();
+                pool_start(&pool, [data, frame, last, &window, &done, total, progress](){
+                    *data = archive_encode(frame, last);
+                    window.release();
+                    progress(++done, total);
+                });
+                previous = frame;
+            }
+            if(spilled){
+                // the frames in flight have their own pixels
+                page.drop();
+            }
+        }
+        pool.waitForDone();
+        bool ok = archive_save(filename, archive);
+        if(ok){
+            savedFull.clear();
+            savedDelta.clear();
+            savedSize = QSize(screenWidth, screenHeight);
+            for(int i = 0; i < archive.size(); i++){
+                for(int j = 0; j < keys[i].size(); j++){
+                    if(archive[i].codecs[j] == CODEC_DELTA){
+                        savedDelta[qMakePair(keys[i][j-1], keys[i][j])] = archive[i].encoded[j];
+                    } else {
+                        savedFull[keys[i][j]] = archive[i].encoded[j];
+                    }
+                }
+            }
+        }
+        return ok;
+    }
+
+    // runs on the gui thread with the canvas locked
+    // The journal starts again from the saved file, pages which
+    // are changed during the save are journaled on top of it.
+    void rebase(const QString &file, const QList<ImageStorage> &snapshot){
+        images.pageType = board->getType();
+        images.overlayType = board->getOverlayType();
+        journal_open(file);
+        for(int id = 0; id <= page_count; id++){
+            if(id != last_page_num && !values.contains(id)){
+                continue;
+            }
+            ImageStorage &page = id == last_page_num ? images : values[id];
+            if(!page.rebase(id, id < snapshot.size() ? &snapshot[id] : nullptr)){
+                if(id != last_page_num){
+                    // the base of the page is journaled with its pixels
+                    fault(id);
+                }
+                page.journalAll(id);
             }
         }
-        archive_create(filename);
+        journal_page(last_page_num);
     }
 
-    void loadArchive(const QString& filename){
-        QMap<QString, QImage> archive = archive_load(filename);
+    // runs on the gui thread with the canvas locked
+    void loadArchive(QSharedPointer<ArchiveFile> archive){
+        journal_open(archive->name);
         clear();
-        for (auto it = archive.begin(); it != archive.end(); ++it) {
-            QString path = it.key();
-            QStringList parts = path.split("/");
-            QImage image = it.value();
-            int page = parts[0].toInt();
-            int frame = parts[1].toInt();
-            printf("Load: page: %d frame %d\n", page, frame);
-            if(page > page_count){
-                page_count = page;
-            }
-            if (!values.contains(page)) {
-                ImageStorage data;
-                values[page] = data;
-                values[page].image_count = 0;
-                values[page].last_image_num = 0;
-            }
-            values[page].saveValue(frame+1, image);
-            values[page].image_count++;
-            values[page].last_image_num = values[page].image_count;
-        }
-        images = values[0];
-        window->loadImage(images.last_image_num);
-        window->update();
-        updateGoBackButtons();
+        document++;
+        for(int i = 0; i < archive->pages.size(); i++){
+            const ArchivePage &page = archive->pages[i];
+            ImageStorage data;
+            data.open(archive, i);
+            // old files do not have the page types
+            data.pageType = page.type < 0 ? board->getType() : page.type;
+            data.overlayType = page.overlay < 0 ? board->getOverlayType() : page.overlay;
+            values[i] = data;
+        }
+        page_count = qMax(0, (int)archive->pages.size() - 1);
+        images = loadValue(0);
     }
 #endif
 
+    // page which is changed in place, not a copy
+    ImageStorage& edit(qint64 id) {
+        if (!values.contains(id)) {
+            values[id] = loadValue(id);
+        }
+        fault(id);
+        return values[id];
+    }
+
     ImageStorage loadValue(qint64 id) {
         if (id > page_count){
             page_count = id;
         }
         if (values.contains(id)) {
+            fault(id);
             return values[id];
         } else {
             ImageStorage imgs = ImageStorage();
@@ -188,15 +895,179 @@ public:
 
 private:
     QMap<qint64, ImageStorage> values;
+    QMap<qint64, SpillSlot> spillSlots;
+    // pages with pixels in memory, least recently used first
+    QList<qint64> recent;
+    // in the cache directory, /tmp is often in memory
+    QTemporaryFile spill;
+
+    void use(qint64 id) {
+        recent.removeAll(id);
+        recent.append(id);
+    }
+
+    // packed pixels of a spilled page, empty if they can not be read
+    QByteArray spilled(qint64 id) {
+        const SpillSlot &slot = spillSlots[id];
+        if(!spill.seek(slot.offset)){
+            return QByteArray();
+        }
+        QByteArray data = spill.read(slot.size);
+        if(data.size() != slot.size){
+            return QByteArray();
+        }
+        return data;
+    }
+
+    void fault(qint64 id) {
+        if(spillSlots.value(id).used){
+            // the slot is kept when the page can not be read back,
+            // so the pixels are not replaced by an empty page
+            ImageStorage page = values[id];
+            if(!page.unpack(spilled(id))){
+                puts("Page load fail");
+                return;
+            }
+            values[id] = page;
+            spillSlots[id].used = false;
+        }
+        use(id);
+        trim(id);
+    }
+
+    // Spills the least recently used pages until the pixels fit in
+    // the memory budget. The current page and the pages next to it stay.
+    void trim(qint64 keep) {
+        qint64 budget = (qint64)get_int((char*)"memory-budget") * 1024 * 1024;
+        if(budget <= 0){
+            return;
+        }
+        qint64 total = images.memory();
+        for(qint64 id : recent){
+            if(id != last_page_num){
+                total += values[id].memory();
+            }
+        }
+        for(int i = 0; i < recent.size() && total > budget; ){
+            qint64 id = recent[i];
+            if(id == keep || qAbs(id - last_page_num) <= 1){
+                i++;
+                continue;
+            }
+            qint64 size = values[id].memory();
+            if(size > 0 && !write(id)){
+                return;
+            }
+            total -= size;
+            recent.removeAt(i);
+        }
+    }
+
+    bool write(qint64 id) {
+        if(!spill.isOpen()){
+            QString dir = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/pardus-pen";
+            QDir().mkpath(dir);
+            // Spill files are unlinked when they are opened, the ones
+            // which are still there are left by crashed sessions.
+            for(const QString &name : QDir(dir).entryList(QStringList("pages-*"), QDir::Files)){
+                QFile::remove(dir + "/" + name);
+            }
+            spill.setFileTemplate(dir + "/pages-XXXXXX");
+            if(!spill.open()){
+                return false;
+            }
+            // the open file is kept until it is closed or the process ends
+            QFile::remove(spill.fileName());
+        }
+        QByteArray data = values[id].pack();
+        SpillSlot &slot = spillSlots[id];
+        if(data.size() > slot.capacity){
+            slot.offset = spill.size();
+            slot.capacity = data.size();
+        }
+        if(!spill.seek(slot.offset) || spill.write(data) != data.size()){
+            return false;
+        }
+        slot.size = data.size();
+        slot.used = true;
+        values[id].drop();
+        return true;
+    }
 };
 PageStorage pages;
 
+// Canvas of a page which is not shown, a page flip
+// swaps it in if the page still has the same frame.
+class PrefetchedPage {
+public:
+    int frame = 0;
+    quint64 key = 0;
+    // Only the shown page has a dense canvas, the others keep
+    // the tiles of it which are not transparent.
+    QSize size;
+    TileDelta canvas;
+    TileDelta dirty;
+};
+// pages next to the shown one
+QMap<qint64, PrefetchedPage> prefetched;
+
+
+// Input of every pointer goes through a one euro filter: jitter is
+// smoothed when it moves slowly, fast lines follow the pointer.
+#define MOTION_MIN_CUTOFF 5.0
+#define MOTION_BETA 0.02
+#define MOTION_DERIVATE_CUTOFF 1.0
+// samples closer than this to the last one are dropped, in 1080p pixels
+#define MOTION_STEP 1.0
+// samples on the line of the last segment extend it, in 1080p pixels
+#define MOTION_TOLERANCE 0.25
+// milliseconds, a new line starts after a longer pause
+#define MOTION_GAP 200
+
+class PointerMotion {
+public:
+    // last input, the next line starts from it
+    QPointF raw;
+    // last sample, the next segment starts with its width
+    QPointF pos;
+    float pressure = 0;
+    // filtered position and velocity in pixels per second
+    QPointF value;
+    QPointF velocity;
+    float speed = 0;
+    // pen of the line, the line is finished with it on release
+    Stroke pen;
+    QElapsedTimer timer;
+
+    void reset(const QPointF &point) {
+        value = point;
+        velocity = QPointF();
+        speed = 0;
+    }
+
+    QPointF filter(const QPointF &point, qint64 ms) {
+        qreal dt = qMax(ms, (qint64)1) / 1000.0;
+        velocity += ((point - value) / dt - velocity) * alpha(MOTION_DERIVATE_CUTOFF, dt);
+        speed = QLineF(QPointF(), velocity).length();
+        value += (point - value) * alpha(MOTION_MIN_CUTOFF + MOTION_BETA * speed, dt);
+        return value;
+    }
+
+private:
+    static qreal alpha(qreal cutoff, qreal dt) {
+        qreal tau = 1 / (2 * M_PI * cutoff);
+        return 1 / (1 + tau / dt);
+    }
+};
+QMap<int, PointerMotion> motion;
 
 int curEventButtons = 0;
 bool isMoved = 0;
 float fpressure = 0;
 
 DrawingWidget::DrawingWidget(QWidget *parent): QWidget(parent) {
+    renderer = new Renderer(this, &image);
+    renderer->start();
     initializeImage(size());
     penType = 1;
     QScreen *screen = QGuiApplication::primaryScreen();
@@ -205,15 +1076,25 @@ DrawingWidget::DrawingWidget(QWidget *parent): QWidget(parent) {
     setFixedSize(screenWidth, screenHeight);
     padding = screenWidth / 240;
     fpressure = get_int((char*)"pressure") / 100.0;
+    // queued samples are drawn once per display frame
+    frameTimer = new QTimer(this);
+    frameTimer->setSingleShot(true);
+    frameTimer->setTimerType(Qt::PreciseTimer);
+    frameTimer->setInterval(1000 / qMax(screen->refreshRate(), (qreal)1));
+    QObject::connect(frameTimer, &QTimer::timeout, [=](){
+        flush();
+    });
 }
 
-DrawingWidget::~DrawingWidget() {}
+DrawingWidget::~DrawingWidget() {
+    // jobs use the canvas and the history of this widget
+    delete renderer;
+}
 
 void DrawingWidget::mousePressEvent(QMouseEvent *event) {
     drawing = true;
     lastPoint = event->position();
     firstPoint = event->position();
-    imageBackup = image;
     curEventButtons = event->buttons();
     isMoved = false;
     if(floatingSettings->isVisible()){
@@ -243,15 +1124,23 @@ void DrawingWidget::mouseReleaseEvent(QMouseEvent *event) {
     if (drawing) {
        drawing = false;
     }
-    images.last_image_num++;
-    images.image_count = images.last_image_num;
-    images.saveValue(images.last_image_num, image.copy());
+    finishLine(POINTER_MOUSE);
+    flush();
+    commit();
+    if(!overlay.isNull()){
+        overlay = QImage();
+        update(overlayRect);
+        overlayRect = QRect();
+    }
     curEventButtons = 0;
 }
 
 void DrawingWidget::initializeImage(const QSize &size) {
+    renderer->lock();
     image = QImage(size, QImage::Format_ARGB32);
     image.fill(QColor("transparent"));
+    renderer->present(image.rect());
+    renderer->unlock();
 }
 
 void DrawingWidget::resizeEvent(QResizeEvent *event) {
@@ -260,30 +1149,115 @@ void DrawingWidget::resizeEvent(QResizeEvent *event) {
 }
 
 void DrawingWidget::paintEvent(QPaintEvent *event) {
-    Q_UNUSED(event);
+    // only the damaged rects are copied, 1:1 without any filtering
+    QRegion damage = event->region();
+    QRegion shape;
+    if(!overlay.isNull()){
+        // overlay has the canvas under the shape too
+        shape = damage.intersected(overlayRect);
+        damage = damage.subtracted(shape);
+    }
+    renderer->frontLock.lock();
     painter.begin(this);
-    painter.setRenderHint(QPainter::Antialiasing, true);
-    painter.setRenderHint(QPainter::SmoothPixmapTransform, true);
-    painter.drawImage(0, 0, image);
+    for(const QRect &rect : damage){
+        painter.drawImage(rect, renderer->front, rect);
+    }
+    for(const QRect &rect : shape){
+        painter.drawImage(rect, overlay, rect.translated(-overlayRect.topLeft()));
+    }
     painter.end();
+    renderer->frontLock.unlock();
 }
 
 
 void DrawingWidget::clear() {
+    queued.clear();
+    renderer->lock();
     image.fill(QColor("transparent"));
     images.clear();
+    renderer->present(image.rect());
+    renderer->unlock();
+    journal_clear(pages.last_page_num);
     update();
 }
 
+void DrawingWidget::commit() {
+    renderer->lock();
+    int frame = images.last_image_num;
+    QRegion region = images.commit(image);
+    renderer->present(region);
+    renderer->unlock();
+    if(images.last_image_num != frame){
+        images.pageType = board->getType();
+        images.overlayType = board->getOverlayType();
+        if(!images.journal(pages.last_page_num, frame - 1)){
+            // the base of the page is rendered for the journal
+            renderer->lock();
+            images.journalAll(pages.last_page_num);
+            renderer->unlock();
+        }
+    }
+}
+
+void DrawingWidget::recover() {
+    // replayed on a canvas of its own, the journal is not written yet
+    QList<JournalRecord> records = journal_read();
+    QImage canvas;
+    int current = -1;
+    pages.saveValue(pages.last_page_num, images);
+    for(const JournalRecord &record : records){
+        if(record.type == JOURNAL_OPEN){
+#ifdef LIBARCHIVE
+            pages.loadArchive(archive_open(record.file));
+#endif
+            current = -1;
+            continue;
+        }
+        if(record.type == JOURNAL_PAGE){
+            pages.last_page_num = record.page;
+            continue;
+        }
+        ImageStorage &page = pages.edit(record.page);
+        switch(record.type){
+            case JOURNAL_STROKE:
+                if(record.page != current){
+                    page.rebuild(canvas);
+                    current = record.page;
+                }
+                page.pageType = record.pageType;
+                page.overlayType = record.overlayType;
+                page.append(canvas, record.frame, record.stroke);
+                break;
+            case JOURNAL_FRAME:
+                if(record.frame >= 1 && record.frame <= page.image_count){
+                    page.last_image_num = record.frame;
+                }
+                current = -1;
+                break;
+            case JOURNAL_CLEAR:
+                page.clear();
+                current = -1;
+                break;
+            case JOURNAL_BASE:
+                page.reset(record.tiles);
+                current = -1;
+                break;
+        }
+    }
+    images = pages.loadValue(pages.last_page_num);
+    board->setType(images.pageType);
+    board->setOverlayType(images.overlayType);
+    loadImage(images.last_image_num);
+    updateGoBackButtons();
+}
 
-int rad = 0;
 
 void DrawingWidget::drawLineTo(const QPointF &endPoint) {
-    drawLineToFunc(lastPoint, endPoint, 1.0);
+    drawLineToFunc(lastPoint, endPoint, 1.0, POINTER_MOUSE);
     lastPoint = endPoint;
 }
 
-void DrawingWidget::drawLineToFunc(QPointF startPoint, QPointF endPoint, qreal pressure) {
+void DrawingWidget::drawLineToFunc(QPointF startPoint, QPointF endPoint, qreal pressure, int pointer) {
     if(startPoint.x() < 0 || startPoint.y() < 0){
         return;
     }
@@ -294,110 +1268,294 @@ void DrawingWidget::drawLineToFunc(QPointF startPoint, QPointF endPoint, qreal p
     if (penType == ERASER) {
         fpenStyle = SPLINE;
     }
-
-    switch(fpenStyle){
-        case SPLINE:
-            painter.begin(&image);
-            break;
-        case LINE:
-        case CIRCLE:
-            startPoint = firstPoint;
-            image = imageBackup;
-            painter.begin(&image);
-            break;
+    QColor color = penColor;
+    color.setAlpha(255);
+    if (penType == MARKER) {
+        color.setAlpha(127);
     }
-    penColor.setAlpha(255);
-    painter.setCompositionMode(QPainter::CompositionMode_Source);
-    switch(penType){
-        case PEN:
-            break;
-        case ERASER:
-            painter.setCompositionMode(QPainter::CompositionMode_Clear);
-            break;
-        case MARKER:
-            penColor.setAlpha(127);
-            break;
+    Stroke pen;
+    pen.penType = penType;
+    pen.penStyle = fpenStyle;
+    pen.color = color.rgba();
+    pen.size = penSize[penType];
+
+    if(penType == ERASER && eraserMode == ERASE_STROKES){
+        eraseStrokes(startPoint, endPoint, stroke_width(pen, 1) / 2);
+        return;
+    }
+    if(!queued.isEmpty() && (fpenStyle != SPLINE || !queued.first().samePen(pen))){
+        flush();
+    }
+    if(fpenStyle != SPLINE){
+        // shapes are previewed on the overlay and drawn on release
+        if(!images.accepts(pen)){
+            commit();
+        }
+        Stroke &stroke = images.record(pen);
+        stroke.shapeTo(firstPoint, endPoint, pressure);
+        QRect rect = stroke_rect(stroke, 1).intersected(image.rect());
+        renderer->frontLock.lock();
+        overlay = renderer->front.copy(rect);
+        renderer->frontLock.unlock();
+        painter.begin(&overlay);
+        painter.translate(-rect.x(), -rect.y());
+        stroke_paint(painter, stroke, 1);
+        painter.end();
+        update(overlayRect.united(rect));
+        overlayRect = rect;
+        return;
+    }
+    PointerMotion &last = motion[pointer];
+    if(last.timer.isValid() && last.raw == startPoint && last.timer.elapsed() >= MOTION_GAP){
+        // the pen stopped, the line is drawn up to it before the filter starts again
+        finishLine(pointer);
+    }
+    bool continued = last.timer.isValid() && last.raw == startPoint && last.timer.elapsed() < MOTION_GAP;
+    last.raw = endPoint;
+    last.pen = pen;
+    QPointF point = endPoint;
+    if(continued){
+        point = last.filter(endPoint, last.timer.restart());
+    } else {
+        last.reset(endPoint);
+        last.timer.start();
     }
+    // Faster lines of the pen are thinner. The width is kept in the samples,
+    // so the stroke looks the same when it is replayed.
+    float width = pressure;
+    if(penType == PEN){
+        float speed = last.speed / 1000 * 1080 / screenHeight;
+        width *= 1 - 0.4f * speed / (speed + 2);
+    }
+    qreal scale = screenHeight / 1080.0;
+    if(continued && QLineF(last.pos, point).length() < MOTION_STEP * scale){
+        // does not change the line
+        return;
+    }
+    if(!queued.contains(pointer)){
+        queued[pointer] = pen;
+    }
+    Stroke &stroke = queued[pointer];
+    if(!continued || !stroke.merge(point, width, MOTION_TOLERANCE * scale)){
+        stroke.lineTo(continued ? last.pos : startPoint, point, continued ? last.pressure : width, width);
+    }
+    last.pos = point;
+    last.pressure = width;
+    if(!frameTimer->isActive()){
+        frameTimer->start();
+    }
+}
 
-    painter.setPen(QPen(penColor, (penSize[penType]*pressure*screenHeight)/1080, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin));
-    painter.setRenderHint(QPainter::Antialiasing, true);
-    painter.setRenderHint(QPainter::SmoothPixmapTransform, true);
+void DrawingWidget::finishLine(int pointer) {
+    auto it = motion.find(pointer);
+    if(it == motion.end() || !it->timer.isValid()){
+        return;
+    }
+    PointerMotion &last = *it;
+    // the filter lags behind the pointer and short moves are dropped
+    if(last.pos != last.raw){
+        if(!queued.contains(pointer)){
+            if(!queued.isEmpty() && !queued.first().samePen(last.pen)){
+                flush();
+            }
+            queued[pointer] = last.pen;
+        }
+        queued[pointer].lineTo(last.pos, last.raw, last.pressure, last.pressure);
+        last.pos = last.raw;
+        if(!frameTimer->isActive()){
+            frameTimer->start();
+        }
+    }
+    // the next line of the pointer starts again
+    last.timer.invalidate();
+}
 
-    switch(fpenStyle){
-        case SPLINE:
-            rad = (penSize[penType]*pressure*screenHeight)/1080;
-            painter.drawLine(startPoint, endPoint);
-            update(QRectF(
-                startPoint, endPoint
-            ).toRect().normalized().adjusted(-rad, -rad, +rad, +rad));
-            break;
-        case LINE:
-            painter.drawLine(startPoint, endPoint);
-            update();
-            break;
-        case CIRCLE:
-            rad = QLineF(startPoint, endPoint).length();
-            painter.drawEllipse(startPoint, rad, rad);
-            update();
-            break;
+void DrawingWidget::eraseStrokes(const QPointF &startPoint, const QPointF &endPoint, qreal radius) {
+    flush();
+    if(!images.erasing()){
+        // a stroke of another pen is not part of the erase entry
+        commit();
     }
+    renderer->lock();
+    QRegion region = images.erase(image, startPoint, endPoint, radius);
+    renderer->present(region);
+    renderer->unlock();
+    update(region);
+}
 
-    painter.end();
+void DrawingWidget::flush() {
+    frameTimer->stop();
+    if(queued.isEmpty()){
+        return;
+    }
+    // every pointer gets its own polyline in the stroke
+    Stroke batch = queued.first();
+    batch.samples.clear();
+    for(auto it = queued.begin(); it != queued.end(); ++it){
+        batch.samples.append(it.value().samples);
+    }
+    queued.clear();
+    if(!images.accepts(batch)){
+        commit();
+    }
+    images.record(batch).samples.append(batch.samples);
+    renderer->push([=](){
+        return images.paint(image, batch);
+    });
 }
 #ifdef LIBARCHIVE
 void DrawingWidget::saveAll(QString file){
-    if (!file.isEmpty()) {
-        if(!file.endsWith(".pen")){
-            file += ".pen";
-        }
-        pages.saveAll(file);
+    if (file.isEmpty() || saving) {
+        return;
     }
+    if(!file.endsWith(".pen")){
+        file += ".pen";
+    }
+    // render jobs must not change the page while it is copied
+    renderer->lock();
+    QList<ImageStorage> snapshot = pages.snapshot();
+    renderer->unlock();
+    if(snapshot.isEmpty()){
+        saveFinished(file, false);
+        return;
+    }
+    saving = true;
+    updateSaveProgress(0);
+    int document = pages.document;
+    pool_start(QThreadPool::globalInstance(), [=](){
+        bool ok = PageStorage::saveAll(file, snapshot, [=](int done, int total){
+            int percent = total > 0 ? done * 100 / total : 100;
+            QMetaObject::invokeMethod(this, [=](){
+                updateSaveProgress(percent);
+            }, Qt::QueuedConnection);
+        });
+        QMetaObject::invokeMethod(this, [=](){
+            saving = false;
+            // the journal is about the document which is open now
+            if(ok && document == pages.document){
+                renderer->lock();
+                pages.rebase(file, snapshot);
+                renderer->unlock();
+            }
+            saveFinished(file, ok);
+        }, Qt::QueuedConnection);
+    });
 }
 
 void DrawingWidget::loadArchive(const QString& filename){
-    pages.loadArchive(filename);
+    // the index is read on the calling thread,
+    // the pages are replaced on the gui thread
+    QSharedPointer<ArchiveFile> archive = archive_open(filename);
+    QMetaObject::invokeMethod(this, [=](){
+        openArchive(archive);
+    }, Qt::QueuedConnection);
+}
+
+void DrawingWidget::openArchive(QSharedPointer<ArchiveFile> archive){
+    queued.clear();
+    renderer->lock();
+    pages.loadArchive(archive);
+    prefetched.clear();
+    renderer->unlock();
+    board->setType(images.pageType);
+    board->setOverlayType(images.overlayType);
+    loadImage(images.last_image_num);
+    updateGoBackButtons();
 }
 #endif
 void DrawingWidget::loadImage(int num){
-    QImage img = images.loadValue(num);
-    img = img.scaled(screenWidth, screenHeight);
-    if(img.isNull()){
-        return;
-    }
-    QPainter p(&image);
-    image.fill(QColor("transparent"));
-    p.drawImage(QPointF(0,0), img);
+    renderer->lock();
+    images.last_image_num = num;
+    images.rebuild(image);
+    renderer->present(image.rect());
+    renderer->unlock();
     update();
+    prefetch();
 }
 
 void DrawingWidget::goNextPage(){
-    images.overlayType = board->getOverlayType();
-    images.pageType = board->getType();
-    pages.saveValue(pages.last_page_num, images);
-    pages.last_page_num++;
-    images = pages.loadValue(pages.last_page_num);
-    board->setType(images.pageType);
-    board->setOverlayType(images.overlayType);
-    loadImage(images.last_image_num);
+    showPage(pages.last_page_num + 1);
 }
 
 void DrawingWidget::goPreviousPage(){
+    showPage(pages.last_page_num - 1);
+}
+
+void DrawingWidget::showPage(int num){
+    renderer->lock();
     images.overlayType = board->getOverlayType();
     images.pageType = board->getType();
+    // the canvas is kept for flipping back
+    PrefetchedPage current;
+    current.frame = images.last_image_num;
+    current.key = images.frameKey(current.frame);
+    current.dirty = images.unload();
+    current.size = image.size();
+    current.canvas = TileDelta::sparse(image);
     pages.saveValue(pages.last_page_num, images);
-    pages.last_page_num--;
+    prefetched[pages.last_page_num] = current;
+    pages.last_page_num = num;
     images = pages.loadValue(pages.last_page_num);
+    PrefetchedPage next = prefetched.take(num);
+    if(next.frame == images.last_image_num && next.key == images.frameKey(next.frame)
+        && next.size == image.size()){
+        // the canvas is reused, only the inked tiles are copied
+        image.fill(Qt::transparent);
+        next.canvas.apply(image);
+        images.adopt(next.dirty);
+    } else {
+        images.rebuild(image);
+    }
+    renderer->present(image.rect());
+    renderer->unlock();
+    journal_page(pages.last_page_num);
     board->setType(images.pageType);
     board->setOverlayType(images.overlayType);
-    loadImage(images.last_image_num);
+    update();
+    prefetch();
+}
+
+void DrawingWidget::prefetch(){
+    int num = pages.last_page_num;
+    for(qint64 id : prefetched.keys()){
+        if(qAbs(id - num) != 1){
+            prefetched.remove(id);
+        }
+    }
+    for(int id = num - 1; id <= num + 1; id += 2){
+        if(id < 0 || id > pages.page_count || prefetched.contains(id)){
+            continue;
+        }
+        // rebuilt on a copy, the copy shares the pixels of the page
+        ImageStorage page = pages.loadValue(id);
+        pool_start(QThreadPool::globalInstance(), [=]() mutable {
+            PrefetchedPage data;
+            data.frame = page.last_image_num;
+            data.key = page.frameKey(data.frame);
+            QImage canvas;
+            page.rebuild(canvas);
+            data.size = canvas.size();
+            data.canvas = TileDelta::sparse(canvas);
+            data.dirty = page.unload();
+            QMetaObject::invokeMethod(this, [=](){
+                if(qAbs(id - pages.last_page_num) == 1){
+                    prefetched[id] = data;
+                }
+            }, Qt::QueuedConnection);
+        });
+    }
 }
 
 void DrawingWidget::goPrevious(){
     if(!isBackAvailable()){
         return;
     }
-    images.last_image_num--;
-    loadImage(images.last_image_num);
+    renderer->lock();
+    QRegion region = images.undo(image);
+    renderer->present(region);
+    renderer->unlock();
+    journal_frame(pages.last_page_num, qMax(1, images.last_image_num - images.journalOffset));
+    update(region);
 }
 
 
@@ -405,8 +1563,12 @@ void DrawingWidget::goNext(){
     if(!isNextAvailable()){
         return;
     }
-    images.last_image_num++;
-    loadImage(images.last_image_num);
+    renderer->lock();
+    QRegion region = images.redo(image);
+    renderer->present(region);
+    renderer->unlock();
+    journal_frame(pages.last_page_num, qMax(1, images.last_image_num - images.journalOffset));
+    update(region);
 }
 
 bool tabletActive = false;
@@ -427,11 +1589,12 @@ bool DrawingWidget::event(QEvent *ev) {
                     storage.saveValue(touchPoint.id(), pos);
                 }
                 else if ((Qt::TouchPointState)touchPoint.state() == Qt::TouchPointReleased) {
+                    finishLine(touchPoint.id());
                     storage.saveValue(touchPoint.id(), QPointF(-1,-1));
                     continue;
                 }
                 QPointF oldPos = storage.loadValue(touchPoint.id());
-                drawLineToFunc(oldPos.toPoint(), pos.toPoint(), touchPoint.pressure());
+                drawLineToFunc(oldPos.toPoint(), pos.toPoint(), touchPoint.pressure(), touchPoint.id());
                 storage.saveValue(touchPoint.id(), pos);
             }
             break;
@@ -440,11 +1603,11 @@ bool DrawingWidget::event(QEvent *ev) {
             QTabletEvent *tabletEvent = static_cast<QTabletEvent*>(ev);
             lastPoint = tabletEvent->position();
             firstPoint = tabletEvent->position();
-            imageBackup = image;
             tabletActive = true;
             break;
         }
         case QEvent::TabletRelease: {
+            finishLine(POINTER_TABLET);
             tabletActive = false;
             break;
         }
@@ -454,8 +1617,8 @@ bool DrawingWidget::event(QEvent *ev) {
             }
             QTabletEvent *tabletEvent = static_cast<QTabletEvent*>(ev);
             QPointF pos = tabletEvent->position();
-            drawLineToFunc(lastPoint, pos.toPoint(), tabletEvent->pressure());
-            lastPoint = tabletEvent->position();
+            drawLineToFunc(lastPoint, pos.toPoint(), tabletEvent->pressure(), POINTER_TABLET);
+            lastPoint = pos.toPoint();
         }
 
         default:
@@ -470,7 +1633,7 @@ int DrawingWidget::getPageNum(){
 
 bool DrawingWidget::isBackAvailable(){
     //printf("%d %d\n", images.last_image_num, images.image_count );
-    return images.last_image_num > images.removed +1;
+    return images.last_image_num > 1;
 }
 
 bool DrawingWidget::isNextAvailable(){
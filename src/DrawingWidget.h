@@ -14,6 +14,12 @@
 
 #include <QImage>
 #include <QPainter>
+#include <QTimer>
+
+#include "Renderer.h"
+#include "Stroke.h"
+
+class ArchiveFile;
 
 
 #define ERASER 0
@@ -25,6 +31,10 @@
 #define CIRCLE 1
 #define SPLINE 2
 
+// eraser modes
+#define ERASE_PIXELS 0
+#define ERASE_STROKES 1
+
 class DrawingWidget : public QWidget {
 public:
     explicit DrawingWidget(QWidget *parent = nullptr);
@@ -44,27 +54,50 @@ public:
     void goNextPage();
     void clear();
 #ifdef LIBARCHIVE
+    // saves in the background, see saveFinished()
     void saveAll(QString filename);
+    // can be called from any thread
     void loadArchive(const QString& filename);
 #endif
     int penType;
     int penStyle;
+    int eraserMode = ERASE_PIXELS;
     void syncPageType(int type);
     int getPageNum();
     bool isBackAvailable();
     bool isNextAvailable();
     void loadImage(int num);
+    // replays the journal of the last session
+    void recover();
 
 protected:
     bool drawing;
-    QImage imageBackup;
+    QImage overlay;
+    QRect overlayRect;
+    // samples waiting for the next frame, by pointer
+    QMap<int, Stroke> queued;
+    QTimer *frameTimer;
+    Renderer *renderer;
+#ifdef LIBARCHIVE
+    bool saving = false;
+    void openArchive(QSharedPointer<ArchiveFile> archive);
+#endif
+    void flush();
+    void commit();
+    void showPage(int num);
+    // renders the pages next to the shown one in the background
+    void prefetch();
     bool eraser;
     void mousePressEvent(QMouseEvent *event) override;
     void mouseMoveEvent(QMouseEvent *event) override;
     void mouseReleaseEvent(QMouseEvent *event) override;
     void resizeEvent(QResizeEvent *event) override;
     void paintEvent(QPaintEvent *event) override;
-    void drawLineToFunc(const QPointF startPoint, const QPointF endPoint, qreal pressure);
+    void drawLineToFunc(const QPointF startPoint, const QPointF endPoint, qreal pressure, int pointer);
+    // draws the rest of the line up to the point where the pointer is released
+    void finishLine(int pointer);
+    // removes the strokes under the eraser line
+    void eraseStrokes(const QPointF &startPoint, const QPointF &endPoint, qreal radius);
     bool event(QEvent * ev);
     QPainter painter;
 };
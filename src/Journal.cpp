@@ -0,0 +1,256 @@
+#include <QByteArray>
+#include <QDataStream>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QStandardPaths>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <unistd.h>
+
+#include "Journal.h"
+
+/*
+The journal is a list of records which are appended as the board changes.
+Every record is its size, a checksum and the payload, so a record which
+is cut by a crash ends the journal instead of breaking it.
+Records are written in batches and synced at most once per JOURNAL_DELAY.
+*/
+#define JOURNAL_DELAY 1000
+
+static QString journalPath(){
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/pardus-pen";
+    QDir().mkpath(dir);
+    return dir + "/journal";
+}
+
+static quint32 checksum(const QByteArray &data){
+    // FNV-1a
+    quint32 hash = 2166136261u;
+    for(char c : data){
+        hash = (hash ^ (quint8)c) * 16777619u;
+    }
+    return hash;
+}
+
+class JournalWriter : public QThread {
+public:
+    JournalWriter(bool keep) {
+        file.setFileName(journalPath());
+        file.open(keep ? QIODevice::Append : QIODevice::WriteOnly | QIODevice::Truncate);
+    }
+
+    ~JournalWriter() {
+        lock.lock();
+        quit = true;
+        changed.wakeAll();
+        lock.unlock();
+        wait();
+        file.close();
+    }
+
+    void add(const QByteArray &payload, bool reset) {
+        QByteArray record;
+        QDataStream out(&record, QIODevice::WriteOnly);
+        out << (quint32)payload.size() << checksum(payload);
+        record.append(payload);
+        lock.lock();
+        if(reset){
+            // records before are about another document
+            buffer.clear();
+            truncate = true;
+        }
+        buffer.append(record);
+        changed.wakeAll();
+        lock.unlock();
+    }
+
+protected:
+    void run() override {
+        lock.lock();
+        while(!quit || !buffer.isEmpty()){
+            if(buffer.isEmpty()){
+                changed.wait(&lock);
+                continue;
+            }
+            // collect the records of the next second
+            QElapsedTimer timer;
+            timer.start();
+            while(!quit && timer.elapsed() < JOURNAL_DELAY){
+                changed.wait(&lock, JOURNAL_DELAY - timer.elapsed());
+            }
+            QByteArray data = buffer;
+            bool reset = truncate;
+            buffer.clear();
+            truncate = false;
+            lock.unlock();
+            if(reset){
+                file.resize(0);
+                file.seek(0);
+            }
+            file.write(data);
+            file.flush();
+            fdatasync(file.handle());
+            lock.lock();
+        }
+        lock.unlock();
+    }
+
+private:
+    QFile file;
+    QByteArray buffer;
+    QMutex lock;
+    QWaitCondition changed;
+    bool truncate = false;
+    bool quit = false;
+};
+
+static JournalWriter *writer = nullptr;
+
+bool journal_exists(){
+    QFile file(journalPath());
+    return file.exists() && file.size() > 0;
+}
+
+QList<JournalRecord> journal_read(){
+    QList<JournalRecord> records;
+    QFile file(journalPath());
+    if(!file.open(QIODevice::ReadOnly)){
+        return records;
+    }
+    QDataStream in(&file);
+    while(!in.atEnd()){
+        quint32 size, sum;
+        in >> size >> sum;
+        if(in.status() != QDataStream::Ok || size > file.size()){
+            break;
+        }
+        QByteArray payload = file.read(size);
+        if((quint32)payload.size() != size || checksum(payload) != sum){
+            break;
+        }
+        QDataStream data(payload);
+        JournalRecord record;
+        data >> record.type >> record.page;
+        switch(record.type){
+            case JOURNAL_OPEN:
+                data >> record.file;
+                break;
+            case JOURNAL_STROKE:
+                data >> record.frame >> record.pageType >> record.overlayType;
+                stroke_read(data, record.stroke);
+                break;
+            case JOURNAL_FRAME:
+                data >> record.frame;
+                break;
+            case JOURNAL_BASE: {
+                QByteArray tiles;
+                data >> tiles;
+                QDataStream raw(qUncompress(tiles));
+                if(!record.tiles.read(raw)){
+                    data.setStatus(QDataStream::ReadCorruptData);
+                }
+                break;
+            }
+        }
+        if(data.status() != QDataStream::Ok){
+            break;
+        }
+        records.append(record);
+    }
+    return records;
+}
+
+void journal_start(bool keep){
+    writer = new JournalWriter(keep);
+    writer->start();
+}
+
+void journal_close(){
+    if(!writer){
+        return;
+    }
+    delete writer;
+    writer = nullptr;
+    QFile::remove(journalPath());
+}
+
+static void journal_add(const JournalRecord &record, bool reset = false){
+    if(!writer){
+        return;
+    }
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out << record.type << record.page;
+    switch(record.type){
+        case JOURNAL_OPEN:
+            out << record.file;
+            break;
+        case JOURNAL_STROKE:
+            out << record.frame << record.pageType << record.overlayType;
+            stroke_write(out, record.stroke);
+            break;
+        case JOURNAL_FRAME:
+            out << record.frame;
+            break;
+        case JOURNAL_BASE: {
+            // a whole frame, it is compressed like the frames of .pen files
+            QByteArray tiles;
+            QDataStream raw(&tiles, QIODevice::WriteOnly);
+            record.tiles.write(raw);
+            out << qCompress(tiles, 1);
+            break;
+        }
+    }
+    writer->add(payload, reset);
+}
+
+void journal_open(const QString &file){
+    JournalRecord record;
+    record.type = JOURNAL_OPEN;
+    record.file = file;
+    journal_add(record, true);
+}
+
+void journal_stroke(int page, int frame, int pageType, int overlayType, const Stroke &stroke){
+    JournalRecord record;
+    record.type = JOURNAL_STROKE;
+    record.page = page;
+    record.frame = frame;
+    record.pageType = pageType;
+    record.overlayType = overlayType;
+    record.stroke = stroke;
+    journal_add(record);
+}
+
+void journal_frame(int page, int frame){
+    JournalRecord record;
+    record.type = JOURNAL_FRAME;
+    record.page = page;
+    record.frame = frame;
+    journal_add(record);
+}
+
+void journal_clear(int page){
+    JournalRecord record;
+    record.type = JOURNAL_CLEAR;
+    record.page = page;
+    journal_add(record);
+}
+
+void journal_base(int page, const TileDelta &tiles){
+    JournalRecord record;
+    record.type = JOURNAL_BASE;
+    record.page = page;
+    record.tiles = tiles;
+    journal_add(record);
+}
+
+void journal_page(int page){
+    JournalRecord record;
+    record.type = JOURNAL_PAGE;
+    record.page = page;
+    journal_add(record);
+}
@@ -0,0 +1,46 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <QList>
+#include <QString>
+
+#include "Stroke.h"
+
+#define JOURNAL_OPEN 0
+#define JOURNAL_STROKE 1
+#define JOURNAL_FRAME 2
+#define JOURNAL_CLEAR 3
+#define JOURNAL_PAGE 4
+#define JOURNAL_BASE 5
+
+// One change of the board, frame is the frame number
+// which the stroke is drawn on or which is shown after undo.
+class JournalRecord {
+public:
+    qint8 type = JOURNAL_OPEN;
+    qint32 page = 0;
+    qint32 frame = 0;
+    qint32 pageType = 0;
+    qint32 overlayType = 0;
+    QString file;
+    Stroke stroke;
+    // pixels which the page starts from, for JOURNAL_BASE
+    TileDelta tiles;
+};
+
+// The journal is written until journal_start() is called
+// and removed by journal_close() on a clean exit.
+bool journal_exists();
+QList<JournalRecord> journal_read();
+void journal_start(bool keep);
+void journal_close();
+
+void journal_open(const QString &file);
+void journal_stroke(int page, int frame, int pageType, int overlayType, const Stroke &stroke);
+void journal_frame(int page, int frame);
+void journal_clear(int page);
+// clears the page and starts it from the tiles
+void journal_base(int page, const TileDelta &tiles);
+void journal_page(int page);
+
+#endif // JOURNAL_H
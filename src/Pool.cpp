@@ -0,0 +1,19 @@
+#include <QRunnable>
+
+#include "Pool.h"
+
+class PoolJob : public QRunnable {
+public:
+    PoolJob(std::function<void()> job) : job(job) {
+        setAutoDelete(true);
+    }
+    void run() override {
+        job();
+    }
+private:
+    std::function<void()> job;
+};
+
+void pool_start(QThreadPool *pool, std::function<void()> job){
+    pool->start(new PoolJob(job));
+}
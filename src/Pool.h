@@ -0,0 +1,12 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <QThreadPool>
+
+#include <functional>
+
+// QThreadPool::start() takes a function only since Qt 5.15,
+// the job is wrapped in a runnable which deletes itself.
+void pool_start(QThreadPool *pool, std::function<void()> job);
+
+#endif // POOL_H
@@ -0,0 +1,76 @@
+#include <QMetaObject>
+
+#include "Renderer.h"
+#include "Tiles.h"
+
+Renderer::Renderer(QWidget *widget, QImage *canvas) : QThread(widget) {
+    this->widget = widget;
+    this->canvas = canvas;
+}
+
+Renderer::~Renderer() {
+    jobLock.lock();
+    quit = true;
+    changed.wakeAll();
+    jobLock.unlock();
+    wait();
+}
+
+void Renderer::push(RenderJob job){
+    jobLock.lock();
+    jobs.append(job);
+    changed.wakeAll();
+    jobLock.unlock();
+}
+
+void Renderer::lock(){
+    // queued jobs must be on the canvas before anyone else touches it
+    jobLock.lock();
+    while(busy || !jobs.isEmpty()){
+        changed.wait(&jobLock);
+    }
+    jobLock.unlock();
+    canvasLock.lock();
+}
+
+void Renderer::unlock(){
+    canvasLock.unlock();
+}
+
+void Renderer::present(const QRegion &region){
+    frontLock.lock();
+    if(front.size() != canvas->size()){
+        front = canvas->copy();
+    } else {
+        for(const QRect &rect : region){
+            copyRect(front, *canvas, rect);
+        }
+    }
+    frontLock.unlock();
+}
+
+void Renderer::run(){
+    jobLock.lock();
+    while(!quit){
+        if(jobs.isEmpty()){
+            changed.wait(&jobLock);
+            continue;
+        }
+        RenderJob job = jobs.takeFirst();
+        busy = true;
+        jobLock.unlock();
+
+        canvasLock.lock();
+        QRegion region = job();
+        present(region);
+        canvasLock.unlock();
+        QMetaObject::invokeMethod(widget, [=](){
+            widget->update(region);
+        }, Qt::QueuedConnection);
+
+        jobLock.lock();
+        busy = false;
+        changed.wakeAll();
+    }
+    jobLock.unlock();
+}
@@ -0,0 +1,44 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <QImage>
+#include <QList>
+#include <QMutex>
+#include <QRegion>
+#include <QThread>
+#include <QWaitCondition>
+#include <QWidget>
+
+#include <functional>
+
+// Job runs on the render thread with the canvas locked
+// and returns the region it changed.
+typedef std::function<QRegion()> RenderJob;
+
+// Render thread which owns the canvas.
+// Finished regions are copied into the front buffer
+// which is the only image used by the paint event.
+class Renderer : public QThread {
+public:
+    Renderer(QWidget *widget, QImage *canvas);
+    ~Renderer();
+    QImage front;
+    QMutex frontLock;
+    void push(RenderJob job);
+    void lock();
+    void unlock();
+    void present(const QRegion &region);
+protected:
+    void run() override;
+private:
+    QWidget *widget;
+    QImage *canvas;
+    QList<RenderJob> jobs;
+    QMutex jobLock;
+    QMutex canvasLock;
+    QWaitCondition changed;
+    bool busy = false;
+    bool quit = false;
+};
+
+#endif // RENDERER_H
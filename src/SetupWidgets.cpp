@@ -15,6 +15,7 @@
 #include "Button.h"
 #include "ScreenShot.h"
 #include "OverView.h"
+#include "Journal.h"
 
 
 extern "C" {
@@ -76,6 +77,7 @@ QWidget *colorDialog;
 QWidget *typeDialog;
 QSlider *thicknessSlider;
 QLabel *thicknessLabel;
+QPushButton *eraserModeButton;
 QLabel *colorLabel;
 
 QString penText = "";
@@ -162,7 +164,9 @@ static void penSizeEvent(){
             padding*2
              + thicknessLabel->size().height()
              + thicknessSlider->size().height()
+             + eraserModeButton->size().height()
         );
+        eraserModeButton->show();
         colorDialog->hide();
         ov->hide();
         colorLabel->hide();
@@ -177,6 +181,7 @@ static void penSizeEvent(){
              + colorDialog->size().height()
              + colorLabel->size().height()
         );
+        eraserModeButton->hide();
         colorDialog->show();
         colorLabel->show();
         ov->show();
@@ -323,6 +328,18 @@ static void setupPenSize(){
     penSettingsLayout->addWidget(thicknessLabel);
     penSettingsLayout->addWidget(thicknessSlider);
 
+    // whole strokes under the eraser are removed, not the pixels
+    eraserModeButton = new QPushButton(_("Erase whole strokes"));
+    eraserModeButton->setCheckable(true);
+    eraserModeButton->setChecked(window->eraserMode == ERASE_STROKES);
+    eraserModeButton->setFixedHeight(butsize);
+    penSettingsLayout->addWidget(eraserModeButton);
+
+    QObject::connect(eraserModeButton, &QPushButton::toggled, [=](bool checked) {
+        window->eraserMode = checked ? ERASE_STROKES : ERASE_PIXELS;
+        set_int((char*)"eraser-mode", window->eraserMode);
+    });
+
     penSettings->show();
 
     QObject::connect(thicknessSlider, &QSlider::valueChanged, [=](int value) {
@@ -813,11 +830,6 @@ static void setupClear(){
 #ifdef LIBARCHIVE
 extern "C" {
 QString archive_target;
-void *save_all(void* arg) {
-    (void)arg;
-    window->saveAll(archive_target);
-    return NULL;
-}
 void *load_archive(void* arg) {
     (void)arg;
     window->loadArchive(archive_target);
@@ -825,18 +837,36 @@ void *load_archive(void* arg) {
 }
 }
 
+QPushButton *saveButton;
+
+void updateSaveProgress(int percent){
+    saveButton->setEnabled(false);
+    saveButton->setText(QString::number(percent) + "%");
+}
+
+void saveFinished(const QString &file, bool ok){
+    saveButton->setEnabled(true);
+    saveButton->setText("");
+    if(ok){
+        return;
+    }
+    QMessageBox messageBox;
+    Qt::WindowFlags flags =  Qt::Dialog | Qt::X11BypassWindowManagerHint;
+    messageBox.setWindowFlags(flags);
+    messageBox.setText(_("Info"));
+    messageBox.setInformativeText(_("Failed To save:") + file);
+    messageBox.setIcon(QMessageBox::Warning);
+    messageBox.exec();
+}
+
 static void setupSave(){
 
-    QPushButton *save = create_button(":images/save.svg", [=](){
+    saveButton = create_button(":images/save.svg", [=](){
         QString file = QFileDialog::getSaveFileName(window, _("Save File"), QDir::homePath(), _("Pen Files (*.pen);;All Files (*.*)"));
-        //window->saveAll(file);
-        pthread_t ptid;
-        // Creating a new thread
-        archive_target = file;
-        pthread_create(&ptid, NULL, &save_all, NULL);
+        window->saveAll(file);
     });
-    save->setStyleSheet(QString("background-color: none;"));
-    floatingWidget->setWidget(save);
+    saveButton->setStyleSheet(QString("background-color: none;"));
+    floatingWidget->setWidget(saveButton);
 
     QPushButton *open = create_button(":images/open.svg", [=](){
         QString filename = QFileDialog::getOpenFileName(window, _("Open File"), QDir::homePath(), _("Pen Files (*.pen);;All Files (*.*)"));
@@ -884,6 +914,7 @@ static void setupExit(){
     args4 << "set" << "org.gnome.mutter" << "overlay-key" << "'SUPER_L'";
     p4.execute("gsettings", args4);
 #endif
+        journal_close();
         QApplication::quit();
         exit(0);
     });
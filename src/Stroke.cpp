@@ -0,0 +1,422 @@
+#include <QLineF>
+#include <QPainterPath>
+#include <QtMath>
+
+#include <string.h>
+
+#include "Brush.h"
+#include "DrawingWidget.h"
+#include "Stroke.h"
+
+extern int screenHeight;
+
+static QPointF samplePoint(const StrokePoint &p){
+    return QPointF(p.x, p.y);
+}
+
+void Stroke::lineTo(const QPointF &start, const QPointF &end, float startPressure, float pressure){
+    if(samples.isEmpty()
+        || samples.last().x != (float)start.x()
+        || samples.last().y != (float)start.y()){
+        // kept negative when there is no pressure
+        samples.append({(float)start.x(), (float)start.y(), -qMax(startPressure, 1e-6f)});
+    }
+    samples.append({(float)end.x(), (float)end.y(), pressure});
+}
+
+void Stroke::shapeTo(const QPointF &start, const QPointF &end, float pressure){
+    // only the last shape of the drag is kept
+    samples.clear();
+    samples.append({(float)start.x(), (float)start.y(), -1});
+    samples.append({(float)end.x(), (float)end.y(), pressure});
+}
+
+bool Stroke::merge(const QPointF &end, float pressure, qreal tolerance){
+    int count = samples.size();
+    if(count < 2 || samples[count-1].pressure < 0 || qAbs(samples[count-1].pressure - pressure) > 0.01f){
+        return false;
+    }
+    QPointF from = samplePoint(samples[count-2]);
+    QPointF last = samplePoint(samples[count-1]);
+    QPointF line = end - from;
+    qreal length = QPointF::dotProduct(line, line);
+    if(length <= 0){
+        return false;
+    }
+    // the last sample has to be between, at most tolerance away from the line
+    qreal t = QPointF::dotProduct(last - from, line) / length;
+    QPointF distance = last - from - line * t;
+    if(t <= 0 || t >= 1 || QPointF::dotProduct(distance, distance) > tolerance * tolerance){
+        return false;
+    }
+    samples[count-1] = {(float)end.x(), (float)end.y(), pressure};
+    return true;
+}
+
+bool Stroke::isEmpty() const {
+    return samples.isEmpty() && tiles.isEmpty() && erased.isEmpty();
+}
+
+bool Stroke::isErase() const {
+    return !erased.isEmpty();
+}
+
+void Stroke::translate(const QPointF &offset){
+    for(StrokePoint &p : samples){
+        p.x += offset.x();
+        p.y += offset.y();
+    }
+}
+
+bool Stroke::samePen(const Stroke &other) const {
+    return penType == other.penType
+        && penStyle == other.penStyle
+        && size == other.size
+        && color == other.color;
+}
+
+qreal stroke_width(const Stroke &stroke, float pressure){
+    return (stroke.size * (qreal)pressure * screenHeight) / 1080;
+}
+
+float stroke_start(const Stroke &stroke, int index){
+    if(stroke.penStyle != SPLINE){
+        // shapes have one width
+        return stroke.samples[index].pressure;
+    }
+    return qAbs(stroke.samples[index-1].pressure);
+}
+
+static QPointF segmentStart(const Stroke &stroke, int index){
+    if(stroke.penStyle == SPLINE){
+        return samplePoint(stroke.samples[index-1]);
+    }
+    return samplePoint(stroke.samples[0]);
+}
+
+QRect stroke_rect(const Stroke &stroke, int index){
+    const StrokePoint &p = stroke.samples[index];
+    qreal width = stroke_width(stroke, qMax(p.pressure, stroke_start(stroke, index)));
+    // the brush draws at least half a pixel around the line
+    // and antialiases one pixel further
+    int pad = qCeil(qMax(width / 2, (qreal)0.5)) + 2;
+    QPointF start = segmentStart(stroke, index);
+    if(stroke.penStyle == CIRCLE){
+        qreal rad = QLineF(start, samplePoint(p)).length();
+        return QRectF(
+            start - QPointF(rad, rad), start + QPointF(rad, rad)
+        ).toAlignedRect().adjusted(-pad, -pad, +pad, +pad);
+    }
+    return QRectF(
+        start, samplePoint(p)
+    ).normalized().toAlignedRect().adjusted(-pad, -pad, +pad, +pad);
+}
+
+QRegion stroke_bounds(const QImage &image, const Stroke &stroke){
+    QRegion region;
+    if(!stroke.tiles.isEmpty()){
+        return stroke.tiles.region(image);
+    }
+    int count = stroke.samples.size();
+    if(count < 2){
+        return region;
+    }
+    if(stroke.penStyle != SPLINE){
+        return QRegion(stroke_rect(stroke, count - 1));
+    }
+    for(int i = 1; i < count; i++){
+        if(stroke.samples[i].pressure >= 0){
+            region += stroke_rect(stroke, i);
+        }
+    }
+    return region;
+}
+
+static qreal pointDistance(const QPointF &p, const QPointF &a, const QPointF &b){
+    QPointF line = b - a;
+    qreal length = QPointF::dotProduct(line, line);
+    qreal t = length > 0 ? qBound((qreal)0, QPointF::dotProduct(p - a, line) / length, (qreal)1) : 0;
+    return QLineF(p, a + line * t).length();
+}
+
+static qreal cross(const QPointF &a, const QPointF &b){
+    return a.x() * b.y() - a.y() * b.x();
+}
+
+static qreal segmentDistance(const QPointF &a, const QPointF &b, const QPointF &c, const QPointF &d){
+    qreal abc = cross(b - a, c - a), abd = cross(b - a, d - a);
+    qreal cda = cross(d - c, a - c), cdb = cross(d - c, b - c);
+    if(((abc > 0 && abd < 0) || (abc < 0 && abd > 0))
+        && ((cda > 0 && cdb < 0) || (cda < 0 && cdb > 0))){
+        // crossing
+        return 0;
+    }
+    return qMin(qMin(pointDistance(a, c, d), pointDistance(b, c, d)),
+                qMin(pointDistance(c, a, b), pointDistance(d, a, b)));
+}
+
+bool stroke_hit(const Stroke &stroke, const QPointF &start, const QPointF &end, qreal radius){
+    int count = stroke.samples.size();
+    if(count < 2 || !stroke.tiles.isEmpty()){
+        return false;
+    }
+    if(stroke.penStyle == CIRCLE){
+        // distance to the center changes from near to far on the line
+        const StrokePoint &p = stroke.samples[count - 1];
+        QPointF center = samplePoint(stroke.samples[0]);
+        qreal rad = QLineF(center, samplePoint(p)).length();
+        qreal closest = pointDistance(center, start, end);
+        qreal farthest = qMax(QLineF(center, start).length(), QLineF(center, end).length());
+        qreal distance = rad < closest ? closest - rad : (rad > farthest ? rad - farthest : 0);
+        return distance <= radius + stroke_width(stroke, p.pressure) / 2;
+    }
+    for(int i = stroke.penStyle == SPLINE ? 1 : count - 1; i < count; i++){
+        const StrokePoint &p = stroke.samples[i];
+        if(p.pressure < 0){
+            continue;
+        }
+        qreal width = stroke_width(stroke, qMax(p.pressure, stroke_start(stroke, i)));
+        if(segmentDistance(segmentStart(stroke, i), samplePoint(p), start, end) <= radius + width / 2){
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool translucent(const Stroke &stroke){
+    return stroke.penType != ERASER && qAlpha(stroke.color) < 255;
+}
+
+static void strokePen(QPainter &painter, const Stroke &stroke, float pressure){
+    if(stroke.penType == ERASER){
+        painter.setCompositionMode(QPainter::CompositionMode_Clear);
+    } else if(translucent(stroke)){
+        painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    } else {
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+    }
+    painter.setPen(QPen(QColor::fromRgba(stroke.color), stroke_width(stroke, pressure), Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin));
+    painter.setRenderHint(QPainter::Antialiasing, true);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform, true);
+}
+
+void stroke_paint(QPainter &painter, const Stroke &stroke, int index){
+    const StrokePoint &p = stroke.samples[index];
+    QPointF start = segmentStart(stroke, index);
+    strokePen(painter, stroke, p.pressure);
+    switch(stroke.penStyle){
+        case SPLINE:
+        case LINE:
+            painter.drawLine(start, samplePoint(p));
+            break;
+        case CIRCLE:
+            qreal rad = QLineF(start, samplePoint(p)).length();
+            painter.drawEllipse(start, rad, rad);
+            break;
+    }
+}
+
+// Lines and polylines of the canvas. A polyline starts at a sample with
+// a negative pressure, every frame batch starts one, so live drawing
+// and replay fill the same outlines and give the same pixels.
+static QRegion brushDraw(QImage &image, const Stroke &stroke, TileDelta *dirty, int first){
+    QRegion region;
+    int count = stroke.samples.size();
+    bool clear = stroke.penType == ERASER;
+    if(stroke.penStyle != SPLINE){
+        const StrokePoint &p = stroke.samples[count - 1];
+        QRect rect = stroke_rect(stroke, count - 1);
+        if(dirty){
+            dirty->touch(image, rect);
+        }
+        brush_line(image, segmentStart(stroke, count - 1), samplePoint(p),
+            stroke_width(stroke, stroke_start(stroke, count - 1)), stroke_width(stroke, p.pressure),
+            stroke.color, clear);
+        return QRegion(rect);
+    }
+    QVector<QPointF> points;
+    QVector<qreal> widths;
+    for(int i = qMax(first, 1); i <= count; i++){
+        if(i == count || stroke.samples[i].pressure < 0){
+            brush_polyline(image, points, widths, stroke.color, clear);
+            points.clear();
+            widths.clear();
+            continue;
+        }
+        const StrokePoint &p = stroke.samples[i];
+        if(points.isEmpty()){
+            points.append(segmentStart(stroke, i));
+            widths.append(stroke_width(stroke, stroke_start(stroke, i)));
+        }
+        points.append(samplePoint(p));
+        widths.append(stroke_width(stroke, p.pressure));
+        // tiles are kept by line, the box of a polyline has more of them
+        QRect rect = stroke_rect(stroke, i);
+        if(dirty){
+            dirty->touch(image, rect);
+        }
+        region += rect;
+    }
+    return region;
+}
+
+void StrokeLayer::grow(const QImage &canvas, const QRect &rect){
+    if(box.contains(rect)){
+        return;
+    }
+    // grown a tile more, so the next segments rarely need a copy
+    QRect next = box.united(rect).adjusted(-TILE_SIZE, -TILE_SIZE, TILE_SIZE, TILE_SIZE).intersected(canvas.rect());
+    QImage nextMask(next.size(), QImage::Format_Alpha8);
+    nextMask.fill(0);
+    // the canvas out of the old box is not changed yet
+    QImage nextUnder = canvas.copy(next);
+    QPoint offset = box.topLeft() - next.topLeft();
+    for(int y = 0; y < box.height(); y++){
+        memcpy(nextMask.scanLine(offset.y() + y) + offset.x(), mask.constScanLine(y), box.width());
+        memcpy(nextUnder.scanLine(offset.y() + y) + offset.x()*sizeof(QRgb), under.constScanLine(y), box.width()*sizeof(QRgb));
+    }
+    box = next;
+    mask = nextMask;
+    under = nextUnder;
+}
+
+QRegion StrokeLayer::draw(QImage &canvas, const Stroke &stroke, TileDelta *dirty, int first){
+    QRegion region;
+    int count = stroke.samples.size();
+    for(int i = stroke.penStyle == SPLINE ? qMax(first, 1) : count - 1; i < count; i++){
+        const StrokePoint &p = stroke.samples[i];
+        if(p.pressure < 0){
+            continue;
+        }
+        QRect rect = stroke_rect(stroke, i).intersected(canvas.rect());
+        if(rect.isEmpty()){
+            continue;
+        }
+        if(dirty){
+            dirty->touch(canvas, rect);
+        }
+        grow(canvas, rect);
+        brush_mask(mask, segmentStart(stroke, i) - box.topLeft(), samplePoint(p) - box.topLeft(),
+            stroke_width(stroke, stroke_start(stroke, i)), stroke_width(stroke, p.pressure));
+        region += rect;
+    }
+    for(const QRect &rect : region){
+        QRect r = rect.intersected(box);
+        for(int y = r.top(); y <= r.bottom(); y++){
+            memcpy(canvas.scanLine(y) + r.x()*sizeof(QRgb),
+                under.constScanLine(y - box.y()) + (r.x() - box.x())*sizeof(QRgb), r.width()*sizeof(QRgb));
+        }
+        brush_composite(canvas, mask, box.topLeft(), r, stroke.color);
+    }
+    return region;
+}
+
+void StrokeLayer::clear(){
+    box = QRect();
+    mask = QImage();
+    under = QImage();
+}
+
+QRegion stroke_draw(QImage &image, const Stroke &stroke, TileDelta *dirty, int first, StrokeLayer *layer){
+    QRegion region;
+    if(!stroke.tiles.isEmpty()){
+        if(dirty){
+            dirty->touch(image, stroke.tiles);
+        }
+        stroke.tiles.apply(image);
+        return QRegion(image.rect());
+    }
+    int count = stroke.samples.size();
+    if(count < 2){
+        return region;
+    }
+    if(brush_supports(image) && stroke.penStyle != CIRCLE){
+        if(!translucent(stroke)){
+            return brushDraw(image, stroke, dirty, first);
+        }
+        // the whole stroke at once when it is replayed
+        StrokeLayer own;
+        return (layer ? layer : &own)->draw(image, stroke, dirty, first);
+    }
+    QPainter painter(&image);
+    if(stroke.penStyle != SPLINE){
+        // shapes are drawn from the first sample to the last one
+        QRect rect = stroke_rect(stroke, count - 1);
+        if(dirty){
+            dirty->touch(image, rect);
+        }
+        stroke_paint(painter, stroke, count - 1);
+        return QRegion(rect);
+    }
+    // Segments of a polyline with the same width are drawn as one path.
+    // Live drawing and replay must split the paths at the same samples.
+    QPainterPath path;
+    QRect rect;
+    float pressure = 0;
+    painter.setBrush(Qt::NoBrush);
+    for(int i = qMax(first, 1); i <= count; i++){
+        if(i == count || stroke.samples[i].pressure < 0
+            || (!path.isEmpty() && stroke.samples[i].pressure != pressure)){
+            if(!path.isEmpty()){
+                strokePen(painter, stroke, pressure);
+                painter.drawPath(path);
+                region += rect;
+                path = QPainterPath();
+                rect = QRect();
+            }
+            if(i == count || stroke.samples[i].pressure < 0){
+                continue;
+            }
+        }
+        const StrokePoint &p = stroke.samples[i];
+        if(path.isEmpty()){
+            path.moveTo(samplePoint(stroke.samples[i-1]));
+            pressure = p.pressure;
+        }
+        path.lineTo(samplePoint(p));
+        QRect segment = stroke_rect(stroke, i);
+        if(dirty){
+            dirty->touch(image, segment);
+        }
+        rect |= segment;
+    }
+    return region;
+}
+
+void stroke_write(QDataStream &out, const Stroke &stroke){
+    out.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    out << stroke.penType << stroke.penStyle << stroke.size << (quint32)stroke.color;
+    out << (quint32)stroke.samples.size();
+    for(const StrokePoint &p : stroke.samples){
+        out << p.x << p.y << p.pressure;
+    }
+    out << (quint32)stroke.erased.size();
+    for(qint32 index : stroke.erased){
+        out << index;
+    }
+}
+
+bool stroke_read(QDataStream &in, Stroke &stroke){
+    in.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    quint32 color, count;
+    in >> stroke.penType >> stroke.penStyle >> stroke.size >> color >> count;
+    stroke.color = color;
+    stroke.samples.clear();
+    for(quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++){
+        StrokePoint p;
+        in >> p.x >> p.y >> p.pressure;
+        stroke.samples.append(p);
+    }
+    stroke.erased.clear();
+    if(in.atEnd()){
+        // written before strokes could be erased
+        return in.status() == QDataStream::Ok;
+    }
+    in >> count;
+    for(quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++){
+        qint32 index;
+        in >> index;
+        stroke.erased.append(index);
+    }
+    return in.status() == QDataStream::Ok;
+}
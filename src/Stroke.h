@@ -0,0 +1,79 @@
+#ifndef STROKE_H
+#define STROKE_H
+
+#include <QColor>
+#include <QDataStream>
+#include <QImage>
+#include <QPainter>
+#include <QPointF>
+#include <QRect>
+#include <QRegion>
+#include <QVector>
+
+#include "Tiles.h"
+
+class StrokePoint {
+public:
+    float x;
+    float y;
+    // negative pressure starts a new polyline,
+    // the polyline starts with the width of its absolute value
+    float pressure;
+};
+
+class Stroke {
+public:
+    // set when the stroke is committed, saved frames are known by it
+    quint64 id = 0;
+    qint8 penType = 0;
+    qint8 penStyle = 0;
+    qint16 size = 0;
+    QRgb color = 0;
+    QVector<StrokePoint> samples;
+    // raster content of the frames loaded from old files
+    TileDelta tiles;
+    // Places in the stroke log of the strokes which this entry
+    // removes, an erase entry has no samples.
+    QVector<qint32> erased;
+
+    void lineTo(const QPointF &start, const QPointF &end, float startPressure, float pressure);
+    void shapeTo(const QPointF &start, const QPointF &end, float pressure);
+    // moves the last sample to end when the line does not bend
+    // more than tolerance at it, false if it is not moved
+    bool merge(const QPointF &end, float pressure, qreal tolerance);
+    bool isEmpty() const;
+    bool isErase() const;
+    void translate(const QPointF &offset);
+    bool samePen(const Stroke &other) const;
+};
+
+// Coverage of a translucent stroke while it is drawn. The canvas under
+// the stroke is kept, so changed parts are composited again from it
+// and every pixel gets the color once.
+class StrokeLayer {
+public:
+    QRegion draw(QImage &canvas, const Stroke &stroke, TileDelta *dirty, int first);
+    void clear();
+private:
+    QRect box;
+    QImage mask;
+    QImage under;
+    void grow(const QImage &canvas, const QRect &rect);
+};
+
+qreal stroke_width(const Stroke &stroke, float pressure);
+// pressure at the start of the segment which ends at the sample
+float stroke_start(const Stroke &stroke, int index);
+QRect stroke_rect(const Stroke &stroke, int index);
+QRegion stroke_bounds(const QImage &image, const Stroke &stroke);
+// true when the line of the eraser from start to end with the given
+// radius touches the stroke, raster strokes are never hit
+bool stroke_hit(const Stroke &stroke, const QPointF &start, const QPointF &end, qreal radius);
+void stroke_paint(QPainter &painter, const Stroke &stroke, int index);
+// layer keeps a translucent stroke which is drawn in batches
+QRegion stroke_draw(QImage &image, const Stroke &stroke, TileDelta *dirty, int first = 0, StrokeLayer *layer = nullptr);
+// pen, samples and erased strokes, raster strokes are not written
+void stroke_write(QDataStream &out, const Stroke &stroke);
+bool stroke_read(QDataStream &in, Stroke &stroke);
+
+#endif // STROKE_H
@@ -0,0 +1,105 @@
+#include <algorithm>
+
+#include "StrokeIndex.h"
+
+/*
+A stroke is added to every cell which its box touches. Strokes out of
+the canvas are kept in the cells at its edge, so the grid stays small.
+Queries look at the cells under the rect and check the boxes, a hit
+test of the eraser reads a few short lists whatever the size of the log.
+*/
+#define CELL_LIMIT 0x7fff
+
+#define cellKey(X, Y) (((Y) << 16) | (X))
+
+static int cellOf(int coord){
+    return qBound(0, coord, CELL_LIMIT * INDEX_CELL) / INDEX_CELL;
+}
+
+void StrokeIndex::insert(int stroke, const QRect &box){
+    if(box.isEmpty()){
+        return;
+    }
+    if(boxes.size() <= stroke){
+        boxes.resize(stroke + 1);
+    }
+    boxes[stroke] = box;
+    for(int cy = cellOf(box.top()); cy <= cellOf(box.bottom()); cy++){
+        for(int cx = cellOf(box.left()); cx <= cellOf(box.right()); cx++){
+            cells[cellKey(cx, cy)].append(stroke);
+        }
+    }
+}
+
+void StrokeIndex::truncate(int stroke){
+    for(int i = boxes.size() - 1; i >= stroke; i--){
+        const QRect &box = boxes[i];
+        if(box.isEmpty()){
+            continue;
+        }
+        for(int cy = cellOf(box.top()); cy <= cellOf(box.bottom()); cy++){
+            for(int cx = cellOf(box.left()); cx <= cellOf(box.right()); cx++){
+                auto cell = cells.find(cellKey(cx, cy));
+                // later strokes are at the end of the cell
+                while(cell != cells.end() && !cell->isEmpty() && cell->last() >= stroke){
+                    cell->removeLast();
+                }
+                if(cell != cells.end() && cell->isEmpty()){
+                    cells.erase(cell);
+                }
+            }
+        }
+    }
+    if(boxes.size() > stroke){
+        boxes.resize(qMax(stroke, 0));
+    }
+}
+
+void StrokeIndex::collect(const QRect &rect, QVector<int> &found) const {
+    if(rect.isEmpty()){
+        return;
+    }
+    for(int cy = cellOf(rect.top()); cy <= cellOf(rect.bottom()); cy++){
+        for(int cx = cellOf(rect.left()); cx <= cellOf(rect.right()); cx++){
+            auto cell = cells.constFind(cellKey(cx, cy));
+            if(cell == cells.constEnd()){
+                continue;
+            }
+            for(int stroke : *cell){
+                if(boxes[stroke].intersects(rect)){
+                    found.append(stroke);
+                }
+            }
+        }
+    }
+}
+
+// strokes on more than one cell are found more than once
+static QVector<int> sorted(QVector<int> found){
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    return found;
+}
+
+QVector<int> StrokeIndex::query(const QRect &rect) const {
+    QVector<int> found;
+    collect(rect, found);
+    return sorted(found);
+}
+
+QVector<int> StrokeIndex::query(const QRegion &region) const {
+    QVector<int> found;
+    for(const QRect &rect : region){
+        collect(rect, found);
+    }
+    return sorted(found);
+}
+
+QRect StrokeIndex::box(int stroke) const {
+    return stroke < boxes.size() ? boxes[stroke] : QRect();
+}
+
+void StrokeIndex::clear(){
+    boxes.clear();
+    cells.clear();
+}
@@ -0,0 +1,32 @@
+#ifndef STROKEINDEX_H
+#define STROKEINDEX_H
+
+#include <QHash>
+#include <QRect>
+#include <QRegion>
+#include <QVector>
+
+#define INDEX_CELL 128
+
+// Uniform grid over the bounding boxes of the strokes of a page.
+// Strokes are known by their place in the stroke log, every cell
+// keeps them in the order of the log.
+class StrokeIndex {
+public:
+    // strokes are inserted in the order of the log
+    void insert(int stroke, const QRect &box);
+    // drops the strokes from stroke on
+    void truncate(int stroke);
+    // strokes whose box intersects the rect or region, in the order of the log
+    QVector<int> query(const QRect &rect) const;
+    QVector<int> query(const QRegion &region) const;
+    // empty for the strokes which are not indexed
+    QRect box(int stroke) const;
+    void clear();
+private:
+    QVector<QRect> boxes;
+    QHash<int, QVector<int>> cells;
+    void collect(const QRect &rect, QVector<int> &found) const;
+};
+
+#endif // STROKEINDEX_H
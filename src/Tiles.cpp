@@ -0,0 +1,239 @@
+#include <string.h>
+
+#include "Tiles.h"
+
+#define tileKey(X, Y) (((Y) << 16) | (X))
+
+QRect tileRect(const QImage &image, const QPoint &pos){
+    return QRect(pos.x()*TILE_SIZE, pos.y()*TILE_SIZE, TILE_SIZE, TILE_SIZE).intersected(image.rect());
+}
+
+static bool sameRows(const QImage &a, const QPoint &pa, const QImage &b, const QPoint &pb, const QSize &size){
+    size_t len = size.width() * sizeof(QRgb);
+    for(int y = 0; y < size.height(); y++){
+        if(memcmp(a.constScanLine(pa.y()+y) + pa.x()*sizeof(QRgb),
+                  b.constScanLine(pb.y()+y) + pb.x()*sizeof(QRgb), len) != 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+static void blit(QImage &dst, const QRect &rect, const QImage &src){
+    if(src.size() != rect.size()){
+        // canvas resized after the tile is stored
+        return;
+    }
+    size_t len = rect.width() * sizeof(QRgb);
+    for(int y = 0; y < rect.height(); y++){
+        memcpy(dst.scanLine(rect.y()+y) + rect.x()*sizeof(QRgb), src.constScanLine(y), len);
+    }
+}
+
+void copyRect(QImage &dst, const QImage &src, const QRect &rect){
+    QRect r = rect.intersected(src.rect()).intersected(dst.rect());
+    size_t len = r.width() * sizeof(QRgb);
+    for(int y = r.top(); y <= r.bottom(); y++){
+        memcpy(dst.scanLine(y) + r.x()*sizeof(QRgb), src.constScanLine(y) + r.x()*sizeof(QRgb), len);
+    }
+}
+
+bool sameRect(const QImage &a, const QImage &b, const QRect &rect){
+    if(a.size() != b.size()){
+        return false;
+    }
+    QRect r = rect.intersected(a.rect());
+    return sameRows(a, r.topLeft(), b, r.topLeft(), r.size());
+}
+
+bool isTransparent(const QImage &image, const QRect &rect){
+    QRect r = rect.intersected(image.rect());
+    for(int y = r.top(); y <= r.bottom(); y++){
+        const QRgb *line = reinterpret_cast<const QRgb*>(image.constScanLine(y));
+        for(int x = r.left(); x <= r.right(); x++){
+            if(qAlpha(line[x]) != 0){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void image_write(QDataStream &out, const QImage &image){
+    QImage data = image.convertToFormat(QImage::Format_ARGB32);
+    out << (qint32)data.width() << (qint32)data.height();
+    for(int y = 0; y < data.height(); y++){
+        out.writeRawData(reinterpret_cast<const char*>(data.constScanLine(y)), data.width()*sizeof(QRgb));
+    }
+}
+
+bool image_read(QDataStream &in, QImage &image){
+    qint32 w, h;
+    in >> w >> h;
+    if(in.status() != QDataStream::Ok || w < 0 || h < 0){
+        return false;
+    }
+    if(w == 0 || h == 0){
+        image = QImage();
+        return true;
+    }
+    image = QImage(w, h, QImage::Format_ARGB32);
+    for(int y = 0; y < h; y++){
+        in.readRawData(reinterpret_cast<char*>(image.scanLine(y)), w*sizeof(QRgb));
+    }
+    return in.status() == QDataStream::Ok;
+}
+
+void TileDelta::touch(const QImage &canvas, const QRect &rect){
+    QRect r = rect.normalized().intersected(canvas.rect());
+    if(r.isEmpty()){
+        return;
+    }
+    for(int ty = r.top() / TILE_SIZE; ty <= r.bottom() / TILE_SIZE; ty++){
+        for(int tx = r.left() / TILE_SIZE; tx <= r.right() / TILE_SIZE; tx++){
+            int key = tileKey(tx, ty);
+            if(touched.contains(key)){
+                continue;
+            }
+            touched.insert(key);
+            Tile tile;
+            tile.pos = QPoint(tx, ty);
+            tile.image = canvas.copy(tileRect(canvas, tile.pos));
+            tiles.append(tile);
+        }
+    }
+}
+
+void TileDelta::touch(const QImage &canvas, const TileDelta &delta){
+    for(const Tile &tile : delta.tiles){
+        touch(canvas, tileRect(canvas, tile.pos));
+    }
+}
+
+void TileDelta::commit(const QImage &canvas){
+    // drop tiles which are touched but not changed
+    QList<Tile> changed;
+    for(const Tile &tile : tiles){
+        QRect rect = tileRect(canvas, tile.pos);
+        if(rect.size() != tile.image.size()
+            || !sameRows(canvas, rect.topLeft(), tile.image, QPoint(0,0), rect.size())){
+            changed.append(tile);
+        }
+    }
+    tiles = changed;
+    touched.clear();
+}
+
+void TileDelta::capture(const QImage &canvas){
+    for(Tile &tile : tiles){
+        tile.image = canvas.copy(tileRect(canvas, tile.pos));
+    }
+}
+
+void TileDelta::apply(QImage &frame) const {
+    for(const Tile &tile : tiles){
+        blit(frame, tileRect(frame, tile.pos), tile.image);
+    }
+}
+
+void TileDelta::apply(QImage &frame, const QRect &rect) const {
+    // rect is on the tile grid, tiles are cut only at the canvas edge
+    for(const Tile &tile : tiles){
+        QRect r = QRect(tile.pos * TILE_SIZE, tile.image.size());
+        if(rect.contains(r)){
+            blit(frame, r.translated(-rect.topLeft()), tile.image);
+        }
+    }
+}
+
+bool TileDelta::isEmpty() const {
+    return tiles.isEmpty();
+}
+
+QRegion TileDelta::region(const QImage &canvas) const {
+    QRegion region;
+    for(const Tile &tile : tiles){
+        region += tileRect(canvas, tile.pos);
+    }
+    return region;
+}
+
+void TileDelta::clear(){
+    tiles.clear();
+    touched.clear();
+}
+
+qint64 TileDelta::bytes() const {
+    qint64 size = 0;
+    for(const Tile &tile : tiles){
+        size += tile.image.sizeInBytes();
+    }
+    return size;
+}
+
+void TileDelta::write(QDataStream &out) const {
+    out << (quint32)tiles.size();
+    for(const Tile &tile : tiles){
+        out << (quint16)tile.pos.x() << (quint16)tile.pos.y();
+        image_write(out, tile.image);
+    }
+}
+
+bool TileDelta::read(QDataStream &in){
+    clear();
+    quint32 count;
+    in >> count;
+    for(quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++){
+        quint16 x, y;
+        Tile tile;
+        in >> x >> y;
+        tile.pos = QPoint(x, y);
+        if(!image_read(in, tile.image)){
+            return false;
+        }
+        tiles.append(tile);
+    }
+    return in.status() == QDataStream::Ok;
+}
+
+TileDelta TileDelta::diff(const QImage &from, const QImage &to){
+    // tiles of "from" which are different in "to"
+    TileDelta delta;
+    if(from.size() != to.size()){
+        return delta;
+    }
+    int cols = (to.width() + TILE_SIZE - 1) / TILE_SIZE;
+    int rows = (to.height() + TILE_SIZE - 1) / TILE_SIZE;
+    for(int ty = 0; ty < rows; ty++){
+        for(int tx = 0; tx < cols; tx++){
+            Tile tile;
+            tile.pos = QPoint(tx, ty);
+            QRect rect = tileRect(to, tile.pos);
+            if(sameRows(from, rect.topLeft(), to, rect.topLeft(), rect.size())){
+                continue;
+            }
+            tile.image = from.copy(rect);
+            delta.tiles.append(tile);
+        }
+    }
+    return delta;
+}
+
+TileDelta TileDelta::sparse(const QImage &image){
+    TileDelta delta;
+    int cols = (image.width() + TILE_SIZE - 1) / TILE_SIZE;
+    int rows = (image.height() + TILE_SIZE - 1) / TILE_SIZE;
+    for(int ty = 0; ty < rows; ty++){
+        for(int tx = 0; tx < cols; tx++){
+            Tile tile;
+            tile.pos = QPoint(tx, ty);
+            QRect rect = tileRect(image, tile.pos);
+            if(isTransparent(image, rect)){
+                continue;
+            }
+            tile.image = image.copy(rect);
+            delta.tiles.append(tile);
+        }
+    }
+    return delta;
+}
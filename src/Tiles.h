@@ -0,0 +1,56 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <QDataStream>
+#include <QImage>
+#include <QList>
+#include <QPoint>
+#include <QRect>
+#include <QRegion>
+#include <QSet>
+
+#define TILE_SIZE 64
+
+class Tile {
+public:
+    QPoint pos;
+    QImage image;
+};
+
+// Pixels of the tiles which are changed on a canvas.
+// Touched tiles keep the old content until capture() is called.
+class TileDelta {
+public:
+    void touch(const QImage &canvas, const QRect &rect);
+    void touch(const QImage &canvas, const TileDelta &delta);
+    void commit(const QImage &canvas);
+    void capture(const QImage &canvas);
+    void apply(QImage &frame) const;
+    // tiles in rect, on a frame which is the part of the canvas in rect
+    void apply(QImage &frame, const QRect &rect) const;
+    bool isEmpty() const;
+    QRegion region(const QImage &canvas) const;
+    void clear();
+    // size of the pixels in memory
+    qint64 bytes() const;
+    // touched tiles are not written
+    void write(QDataStream &out) const;
+    bool read(QDataStream &in);
+    static TileDelta diff(const QImage &from, const QImage &to);
+    // tiles of the image which are not fully transparent,
+    // applied on a transparent frame it gives the image back
+    static TileDelta sparse(const QImage &image);
+private:
+    QList<Tile> tiles;
+    QSet<int> touched;
+};
+
+QRect tileRect(const QImage &image, const QPoint &pos);
+void copyRect(QImage &dst, const QImage &src, const QRect &rect);
+bool sameRect(const QImage &a, const QImage &b, const QRect &rect);
+bool isTransparent(const QImage &image, const QRect &rect);
+// raw ARGB32 pixels, null images are written as 0x0
+void image_write(QDataStream &out, const QImage &image);
+bool image_read(QDataStream &in, QImage &image);
+
+#endif // TILES_H
@@ -13,6 +13,7 @@ extern int screenHeight;
 WhiteBoard::WhiteBoard(QWidget *parent) : QWidget(parent) {
     setFixedSize(screenWidth, screenHeight);
     setStyleSheet("background: none");
+    gridCount = get_int((char*)"grid-count");
     show();
 }
 
@@ -25,11 +26,19 @@ int WhiteBoard::getOverlayType(){
 }
 
 void WhiteBoard::setOverlayType(int page){
+    if(overlayType == page && cacheValid){
+        return;
+    }
     set_int((char*)"page-overlay",page);
     overlayType = page;
+    gridCount = get_int((char*)"grid-count");
+    cacheValid = false;
     update();
 }
 void WhiteBoard::setType(int page){
+    if(type == page && cacheValid){
+        return;
+    }
     set_int((char*)"page",page);
     type = page;
     if(page == TRANSPARENT){
@@ -43,14 +52,26 @@ void WhiteBoard::setType(int page){
         lineColor = Qt::black;
     }
     lineColor.setAlpha(127);
+    cacheValid = false;
     update();
 }
 
 void WhiteBoard::paintEvent(QPaintEvent *event) {
-    Q_UNUSED(event);
-
-    gridSize = (float)screenHeight / (float)get_int((char*)"grid-count");
+    if(!cacheValid || cache.size() != size()){
+        renderBackground();
+    }
     painter.begin(this);
+    for(const QRect &rect : event->region()){
+        painter.drawPixmap(rect, cache, rect);
+    }
+    painter.end();
+}
+
+void WhiteBoard::renderBackground() {
+    gridSize = (float)screenHeight / (float)gridCount;
+    cache = QPixmap(size());
+    cache.fill(Qt::transparent);
+    painter.begin(&cache);
     painter.setRenderHint(QPainter::Antialiasing);
 
     painter.fillRect(rect(), background);
@@ -78,6 +99,7 @@ void WhiteBoard::paintEvent(QPaintEvent *event) {
             break;
     }
     painter.end();
+    cacheValid = true;
 }
 
 void WhiteBoard::drawSquarePaper() {
@@ -5,6 +5,8 @@
 #include <QResizeEvent>
 #include <QScreen>
 #include <QApplication>
+#include <QPainter>
+#include <QPixmap>
 
 #define TRANSPARENT 0
 #define WHITE 1
@@ -32,6 +34,11 @@ private:
     int type = 0;
     QPainter painter;
     float gridSize;
+    int gridCount;
+    // background is rendered once and blitted on repaints
+    QPixmap cache;
+    bool cacheValid = false;
+    void renderBackground();
     void paintEvent(QPaintEvent *event) override ;
 };
 
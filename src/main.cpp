@@ -4,6 +4,7 @@
 #include <QMainWindow>
 #include <QColorDialog>
 #include <QProcess>
+#include <QMessageBox>
 
 #include <stdlib.h>
 #include <locale.h>
@@ -15,6 +16,7 @@
 #include "FloatingSettings.h"
 #include "WhiteBoard.h"
 #include "Button.h"
+#include "Journal.h"
 
 #define _(String) gettext(String)
 
@@ -119,6 +121,7 @@ int main(int argc, char *argv[]) {
     window->penSize[PEN] = get_int((char*)"pen-size");
     window->penSize[ERASER] = get_int((char*)"eraser-size");
     window->penSize[MARKER] = get_int((char*)"marker-size");
+    window->eraserMode = get_int((char*)"eraser-mode");
     window->penType=PEN;
     window->penStyle=SPLINE;
     window->penColor = QColor(get_string((char*)"color"));
@@ -162,6 +165,22 @@ int main(int argc, char *argv[]) {
     QObject::connect(QGuiApplication::primaryScreen(), &QScreen::geometryChanged,
                      handleGeometryChange);
 
+    // the journal is left behind when the last session did not exit
+    bool recovered = false;
+    if(journal_exists()){
+        QMessageBox messageBox;
+        Qt::WindowFlags flags =  Qt::Dialog | Qt::X11BypassWindowManagerHint;
+        messageBox.setWindowFlags(flags);
+        messageBox.setText(_("Recover the last session?"));
+        messageBox.setIcon(QMessageBox::Question);
+        messageBox.setStandardButtons(QMessageBox::Yes | QMessageBox::No);
+        if(messageBox.exec() == QMessageBox::Yes){
+            window->recover();
+            recovered = true;
+        }
+    }
+    journal_start(recovered);
+
 #ifdef LIBARCHIVE
     if (argc > 1) {
         pthread_t ptid;
@@ -2,25 +2,106 @@
 GSettings* settings;
 #include "settings.h"
 
+// Values are served from memory and written back in the background.
+// Writes are delayed until there is no new one for WRITE_DELAY ms.
+#define WRITE_DELAY 500
+
+static GHashTable* cache;
+static GHashTable* pending;
+static GMutex lock;
+static GMutex write_lock;
+static GCond changed;
+
+static GVariant* get_value(char* name){
+    g_mutex_lock(&lock);
+    GVariant* value = g_hash_table_lookup(cache, name);
+    if(!value){
+        value = g_settings_get_value(settings, name);
+        g_hash_table_insert(cache, g_strdup(name), value);
+    }
+    g_variant_ref(value);
+    g_mutex_unlock(&lock);
+    return value;
+}
+
+static void set_value(char* name, GVariant* value){
+    g_variant_ref_sink(value);
+    g_mutex_lock(&lock);
+    g_hash_table_insert(cache, g_strdup(name), g_variant_ref(value));
+    g_hash_table_insert(pending, g_strdup(name), value);
+    g_cond_signal(&changed);
+    g_mutex_unlock(&lock);
+}
+
+static void write_pending(GSettings* target){
+    g_mutex_lock(&write_lock);
+    g_mutex_lock(&lock);
+    GHashTable* values = pending;
+    pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+    g_mutex_unlock(&lock);
+    if(g_hash_table_size(values) > 0){
+        GHashTableIter iter;
+        gpointer name, value;
+        g_hash_table_iter_init(&iter, values);
+        while(g_hash_table_iter_next(&iter, &name, &value)){
+            g_settings_set_value(target, name, value);
+        }
+        g_settings_sync();
+    }
+    g_hash_table_unref(values);
+    g_mutex_unlock(&write_lock);
+}
+
+static gpointer writer(gpointer data){
+    (void)data;
+    // own instance, dconf is never touched by the gui thread
+    GSettings* target = g_settings_new(SCHEME);
+    g_mutex_lock(&lock);
+    while(TRUE){
+        while(g_hash_table_size(pending) == 0){
+            g_cond_wait(&changed, &lock);
+        }
+        gint64 end = g_get_monotonic_time() + WRITE_DELAY * G_TIME_SPAN_MILLISECOND;
+        while(g_cond_wait_until(&changed, &lock, end)){
+            end = g_get_monotonic_time() + WRITE_DELAY * G_TIME_SPAN_MILLISECOND;
+        }
+        g_mutex_unlock(&lock);
+        write_pending(target);
+        g_mutex_lock(&lock);
+    }
+    return NULL;
+}
+
+void settings_flush() {
+    write_pending(settings);
+}
+
 void settings_init() {
     settings = g_settings_new (SCHEME);
+    cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+    pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+    g_thread_unref(g_thread_new("settings", writer, NULL));
+    atexit(settings_flush);
 }
 
 char* get_string(char* name){
-    return strdup(g_settings_get_string(settings, name));
+    GVariant* value = get_value(name);
+    char* ret = strdup(g_variant_get_string(value, NULL));
+    g_variant_unref(value);
+    return ret;
 }
 
 void set_string(char* name, char* value) {
-    g_settings_set_string(settings, name, value);
-    g_settings_sync();
+    set_value(name, g_variant_new_string(value));
 }
 
 int get_int(char* name){
-    return g_settings_get_int(settings, name);
+    GVariant* value = get_value(name);
+    int ret = g_variant_get_int32(value);
+    g_variant_unref(value);
+    return ret;
 }
 
 void set_int(char* name, int value) {
-    g_settings_set_int(settings, name, value);
-    g_settings_sync();
+    set_value(name, g_variant_new_int32(value));
 }
-
@@ -1,5 +1,6 @@
 #define SCHEME "tr.org.pardus.pen"
 void settings_init();
+void settings_flush();
 char* get_string(char* name);
 void set_string(char* name, char* value);
 int get_int(char* name);